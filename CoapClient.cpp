@@ -0,0 +1,272 @@
+#include "Arduino.h"
+#include "CoapClient.h"
+
+// Option delta and length nibbles, 13 and 14 meaning 1 or 2 extended bytes
+static uint8_t optionNibble(uint16_t value)
+{
+  return value < 13 ? value : value < 269 ? 13 : 14;
+}
+
+CoapClient::CoapClient(UDP& udp)
+{
+  _udp = &udp;
+}
+
+// Open a local port for the responses. `seed` should be random, so message
+// IDs and tokens don't repeat those used before a reboot.
+void CoapClient::begin(uint32_t seed)
+{
+  _messageId = seed & 0xFFFF;
+  _token = seed;
+  _udp->begin(0);
+}
+
+// POST `payload` to coap://host:port/path?query and wait for the response.
+// Returns its code, e.g. 201 or 204 once the server has accepted it, or one
+// of the errors.
+int CoapClient::post(const char* host, uint16_t port, const char* path, const char* query,
+                     MeasurementPayload& payload)
+{
+  if (!beginPost(host, port, path, query, payload))
+  {
+    return ERROR_SEND;
+  }
+
+  int code;
+  while ((code = pollPost()) == PENDING)
+  {
+    delay(1);
+  }
+  return code;
+}
+
+// Send the POST of post() and return; pollPost() does the rest. The
+// arguments have to stay valid until it's done. Returns false if the
+// request couldn't be sent, or another is still in flight.
+bool CoapClient::beginPost(const char* host, uint16_t port, const char* path, const char* query,
+                           MeasurementPayload& payload)
+{
+  if (_busy)
+  {
+    return false;
+  }
+
+  _host = host;
+  _port = port;
+  _path = path;
+  _query = query;
+  _payload = &payload;
+  _requestId = _messageId++;
+  _token++;
+  _retransmissions = 0;
+  _acknowledged = false;
+
+  // Randomized so devices that lost the server together don't retry together
+  _timeout = ACK_TIMEOUT + random(ACK_TIMEOUT / 2);
+  _sent = millis();
+  _busy = send();
+  return _busy;
+}
+
+// Handle what has arrived for the request of beginPost() and retransmit it
+// when due, without waiting. Returns PENDING until the response or an error
+// ends the exchange, then what post() would have.
+int CoapClient::pollPost()
+{
+  if (!_busy)
+  {
+    return ERROR_SEND;
+  }
+
+  int code = receive();
+  if (code == PENDING && millis() - _sent >= _timeout)
+  {
+    if (_acknowledged || _retransmissions == MAX_RETRANSMIT)
+    {
+      code = ERROR_TIMEOUT;
+    }
+    else
+    {
+      _retransmissions++;
+      _timeout *= 2;
+      _sent = millis();
+      code = send() ? PENDING : ERROR_SEND;
+    }
+  }
+
+  _busy = code == PENDING;
+  return code;
+}
+
+// Whether a request started by beginPost() is still in flight.
+bool CoapClient::busy()
+{
+  return _busy;
+}
+
+// Times the last request was sent again for lack of an ACK.
+uint8_t CoapClient::retransmissions()
+{
+  return _retransmissions;
+}
+
+bool CoapClient::send()
+{
+  const char* path = _path;
+  uint16_t messageId = _requestId;
+  if (!_udp->beginPacket(_host, _port))
+  {
+    return false;
+  }
+
+  // Version 1, confirmable, POST
+  uint8_t header[4 + sizeof(_token)] = {
+    (uint8_t)(0x40 | (TYPE_CON << 4) | sizeof(_token)), 0x02,
+    (uint8_t)(messageId >> 8), (uint8_t)(messageId & 0xFF)
+  };
+  memcpy(header + 4, &_token, sizeof(_token));
+  _udp->write(header, sizeof(header));
+
+  // Options go in increasing order: one Uri-Path per segment, then the
+  // Content-Format as a minimal length integer, then the Uri-Query
+  _lastOption = 0;
+  while (*path != '\0')
+  {
+    size_t length = strcspn(path, "/");
+    if (length > 0)
+    {
+      writeOption(OPTION_URI_PATH, (const uint8_t*)path, length);
+    }
+    path += length;
+    while (*path == '/')
+    {
+      path++;
+    }
+  }
+
+  uint16_t format = _payload->contentFormat();
+  uint8_t formatValue[2] = { (uint8_t)(format >> 8), (uint8_t)(format & 0xFF) };
+  uint8_t formatLength = format > 0xFF ? 2 : format > 0 ? 1 : 0;
+  writeOption(OPTION_CONTENT_FORMAT, formatValue + sizeof(formatValue) - formatLength, formatLength);
+
+  if (_query != nullptr && *_query != '\0')
+  {
+    writeOption(OPTION_URI_QUERY, (const uint8_t*)_query, strlen(_query));
+  }
+
+  if (_payload->size() > 0)
+  {
+    _udp->write(0xFF);
+
+    uint8_t buffer[64];
+    int length;
+    _payload->rewind();
+    while ((length = _payload->read(buffer, sizeof(buffer))) > 0)
+    {
+      _udp->write(buffer, length);
+    }
+  }
+
+  return _udp->endPacket();
+}
+
+// Go through the datagrams that have arrived for the response to the
+// request in flight, either piggybacked on its ACK or, after an empty ACK,
+// sent separately. Returns PENDING if it isn't there yet.
+int CoapClient::receive()
+{
+  int size;
+  while ((size = _udp->parsePacket()) > 0)
+  {
+    if (size < 4)
+    {
+      continue;
+    }
+
+    uint8_t header[4 + sizeof(_token)];
+    int length = _udp->read(header, sizeof(header));
+    if (length < 4 || (header[0] >> 6) != 1)
+    {
+      continue;
+    }
+
+    uint8_t type = (header[0] >> 4) & 0x03;
+    uint8_t code = header[1];
+    uint16_t id = (header[2] << 8) | header[3];
+    bool ours = (header[0] & 0x0F) == sizeof(_token) && length == sizeof(header)
+                && memcmp(header + 4, &_token, sizeof(_token)) == 0;
+    int response = (code >> 5) * 100 + (code & 0x1F);
+
+    if (TYPE_RST == type && id == _requestId)
+    {
+      return ERROR_RESET;
+    }
+
+    if (TYPE_ACK == type && id == _requestId)
+    {
+      if (code == 0 && !_acknowledged)
+      {
+        // The request arrived, stop retransmitting and give the server time
+        // to respond
+        _acknowledged = true;
+        _sent = millis();
+        _timeout = RESPONSE_TIMEOUT;
+      }
+      else if (code != 0 && ours)
+      {
+        return response;
+      }
+      continue;
+    }
+
+    if ((TYPE_CON == type || TYPE_NON == type) && code != 0 && ours)
+    {
+      if (TYPE_CON == type)
+      {
+        acknowledge(id);
+      }
+      return response;
+    }
+
+    // Anything else answers an earlier request, or a retransmission that was
+    // already answered
+  }
+
+  return PENDING;
+}
+
+void CoapClient::writeOption(uint8_t number, const uint8_t* value, uint16_t length)
+{
+  uint16_t delta = number - _lastOption;
+  _udp->write((uint8_t)((optionNibble(delta) << 4) | optionNibble(length)));
+  writeExtended(delta);
+  writeExtended(length);
+  _udp->write(value, length);
+  _lastOption = number;
+}
+
+void CoapClient::writeExtended(uint16_t value)
+{
+  if (value >= 269)
+  {
+    value -= 269;
+    _udp->write((uint8_t)(value >> 8));
+    _udp->write((uint8_t)(value & 0xFF));
+  }
+  else if (value >= 13)
+  {
+    _udp->write((uint8_t)(value - 13));
+  }
+}
+
+// An empty ACK for a separate response sent as a confirmable message.
+void CoapClient::acknowledge(uint16_t messageId)
+{
+  uint8_t header[4] = {
+    (uint8_t)(0x40 | (TYPE_ACK << 4)), 0x00,
+    (uint8_t)(messageId >> 8), (uint8_t)(messageId & 0xFF)
+  };
+  _udp->beginPacket(_udp->remoteIP(), _udp->remotePort());
+  _udp->write(header, sizeof(header));
+  _udp->endPacket();
+}
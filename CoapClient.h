@@ -0,0 +1,75 @@
+#ifndef COAP_CLIENT_H
+#define COAP_CLIENT_H
+
+#include <Udp.h>
+#include "MeasurementPayload.h"
+
+// Sends a MeasurementPayload as a confirmable CoAP POST (RFC 7252) in a
+// single UDP datagram. The request is retransmitted with a doubling timeout
+// until it is acknowledged. Message IDs count up from a random start, so the
+// server can drop retransmissions it has already seen, and responses are
+// matched by message ID and token, so stale or duplicate ones are ignored.
+//
+// The payload is regenerated for each retransmission instead of being kept
+// in a buffer, and must fit in MAX_PAYLOAD bytes.
+//
+// beginPost() sends the request and pollPost(), called until it stops
+// returning PENDING, retransmits and picks up the response, so a sketch can
+// go on while the exchange takes its up to 45 s. post() does both, blocking.
+class CoapClient
+{
+  public:
+    static const uint16_t MAX_PAYLOAD = 1024;       // Keeps datagrams unfragmented
+    static const uint16_t ACK_TIMEOUT = 2000;       // First wait for an ACK (ms)
+    static const uint8_t MAX_RETRANSMIT = 3;
+    static const uint16_t RESPONSE_TIMEOUT = 5000;  // Wait for a separate response (ms)
+
+    // Errors, besides response codes as class * 100 + detail, e.g. 204 for 2.04
+    static const int PENDING = 0;
+    static const int ERROR_SEND = -1;
+    static const int ERROR_TIMEOUT = -2;
+    static const int ERROR_RESET = -3;
+
+    CoapClient(UDP& udp);
+    void begin(uint32_t seed);
+    int post(const char* host, uint16_t port, const char* path, const char* query,
+             MeasurementPayload& payload);
+    bool beginPost(const char* host, uint16_t port, const char* path, const char* query,
+                   MeasurementPayload& payload);
+    int pollPost();
+    bool busy();
+    uint8_t retransmissions();
+
+  private:
+    enum TYPE { TYPE_CON, TYPE_NON, TYPE_ACK, TYPE_RST };
+
+    static const uint8_t OPTION_URI_PATH = 11;
+    static const uint8_t OPTION_CONTENT_FORMAT = 12;
+    static const uint8_t OPTION_URI_QUERY = 15;
+
+    UDP* _udp;
+    uint16_t _messageId = 0;
+    uint32_t _token = 0;
+    uint8_t _lastOption;
+    uint8_t _retransmissions = 0;
+
+    // Request in flight, between beginPost() and the end of pollPost()
+    bool _busy = false;
+    const char* _host;
+    uint16_t _port;
+    const char* _path;
+    const char* _query;
+    MeasurementPayload* _payload;
+    uint16_t _requestId;
+    uint32_t _sent;
+    uint32_t _timeout;
+    bool _acknowledged;
+
+    bool send();
+    int receive();
+    void writeOption(uint8_t number, const uint8_t* value, uint16_t length);
+    void writeExtended(uint16_t value);
+    void acknowledge(uint16_t messageId);
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include "Arduino.h"
+#include "GzipPayload.h"
+
+// gzip member header: deflate, no name or time, unknown OS
+static const uint8_t GZIP_HEADER[] PROGMEM = { 0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF };
+
+// Deflate length codes 257-285 and distance codes 0-29: first value of each
+// code and the number of extra bits following it (RFC 1951, 3.2.5)
+static const uint16_t LENGTH_BASE[] PROGMEM = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t LENGTH_EXTRA[] PROGMEM = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DISTANCE_BASE[] PROGMEM = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DISTANCE_EXTRA[] PROGMEM = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// CRC-32 as used by gzip, four bits at a time
+static const uint32_t CRC_NIBBLES[] PROGMEM = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t reverseBits(uint32_t value, uint8_t count)
+{
+  uint32_t reversed = 0;
+  while (count-- > 0)
+  {
+    reversed = (reversed << 1) | (value & 1);
+    value >>= 1;
+  }
+  return reversed;
+}
+
+// Compress `payload` once to find the size of the result, then rewind it for
+// reading. The payload must have been begun and is read through from here on.
+void GzipPayload::begin(MeasurementPayload& payload)
+{
+  _payload = &payload;
+
+  rewind();
+  _size = 0;
+  while (_state != STATE_DONE)
+  {
+    produce();
+    _size += _outLen;
+  }
+
+  rewind();
+}
+
+// Start over from the beginning of the payload, e.g. to retry a request.
+void GzipPayload::rewind()
+{
+  _payload->rewind();
+  _position = 0;
+  _state = STATE_HEADER;
+  _pos = 0;
+  _end = 0;
+  memset(_hash, 0xFF, sizeof(_hash));
+  _crc = 0xFFFFFFFF;
+  _inputSize = 0;
+  _bits = 0;
+  _bitCount = 0;
+  _outLen = 0;
+  _outPos = 0;
+}
+
+size_t GzipPayload::size()
+{
+  return _size;
+}
+
+int GzipPayload::available()
+{
+  return _size - _position;
+}
+
+int GzipPayload::read()
+{
+  if (!next())
+  {
+    return -1;
+  }
+
+  _position++;
+  return _out[_outPos++];
+}
+
+int GzipPayload::read(uint8_t* buffer, size_t length)
+{
+  size_t copied = 0;
+
+  while (copied < length && next())
+  {
+    size_t chunk = min(length - copied, (size_t)(_outLen - _outPos));
+    memcpy(buffer + copied, _out + _outPos, chunk);
+    _outPos += chunk;
+    _position += chunk;
+    copied += chunk;
+  }
+
+  return copied;
+}
+
+size_t GzipPayload::readBytes(char* buffer, size_t length)
+{
+  return read((uint8_t*)buffer, length);
+}
+
+int GzipPayload::peek()
+{
+  if (!next())
+  {
+    return -1;
+  }
+
+  return _out[_outPos];
+}
+
+size_t GzipPayload::write(uint8_t /* ch */)
+{
+  return 0;
+}
+
+// Make sure there are output bytes left to read, compressing more of the
+// payload if needed. False once everything has been read.
+bool GzipPayload::next()
+{
+  while (_outPos == _outLen && _state != STATE_DONE)
+  {
+    produce();
+  }
+
+  return _outPos < _outLen;
+}
+
+// Replace the output buffer with the next few bytes of the gzip stream: the
+// header, one literal or match, or the end of the stream.
+void GzipPayload::produce()
+{
+  _outLen = 0;
+  _outPos = 0;
+
+  switch (_state)
+  {
+    case STATE_HEADER:
+      memcpy_P(_out, GZIP_HEADER, sizeof(GZIP_HEADER));
+      _outLen = sizeof(GZIP_HEADER);
+
+      // A single final block with the fixed Huffman codes
+      writeBits(1, 1);
+      writeBits(1, 2);
+      _state = STATE_DATA;
+      break;
+
+    case STATE_DATA:
+    {
+      fill();
+      if (_pos == _end)
+      {
+        _state = STATE_TRAILER;
+        break;
+      }
+
+      uint16_t lookahead = _end - _pos;
+      uint16_t length = 0;
+      uint16_t distance = 0;
+      if (lookahead >= MIN_MATCH)
+      {
+        uint16_t h = hash(_pos);
+        uint16_t candidate = _hash[h];
+        _hash[h] = _pos;
+
+        if (candidate != NO_POSITION && candidate < _pos && _pos - candidate <= WINDOW_SIZE)
+        {
+          uint16_t longest = min(lookahead, MAX_MATCH);
+          while (length < longest && _buffer[candidate + length] == _buffer[_pos + length])
+          {
+            length++;
+          }
+          distance = _pos - candidate;
+        }
+      }
+
+      if (length >= MIN_MATCH)
+      {
+        writeMatch(length, distance);
+        for (uint16_t i = 1; i < length; i++)
+        {
+          insert(_pos + i);
+        }
+        _pos += length;
+      }
+      else
+      {
+        writeSymbol(_buffer[_pos]);
+        _pos++;
+      }
+      break;
+    }
+
+    case STATE_TRAILER:
+    {
+      writeSymbol(256);
+      if (_bitCount > 0)
+      {
+        writeBits(0, 8 - _bitCount);
+      }
+
+      uint32_t crc = ~_crc;
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        writeByte(crc >> (8 * i));
+      }
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        writeByte(_inputSize >> (8 * i));
+      }
+      _state = STATE_DONE;
+      break;
+    }
+
+    case STATE_DONE:
+      break;
+  }
+}
+
+// Keep at least MAX_MATCH bytes of lookahead while the payload has more,
+// sliding the history down to WINDOW_SIZE bytes when the buffer is full.
+void GzipPayload::fill()
+{
+  if (_end - _pos >= MAX_MATCH || _payload->available() <= 0)
+  {
+    return;
+  }
+
+  if (_end == BUFFER_SIZE)
+  {
+    uint16_t shift = _pos - WINDOW_SIZE;
+    memmove(_buffer, _buffer + shift, _end - shift);
+    _pos -= shift;
+    _end -= shift;
+
+    for (uint16_t i = 0; i < (1 << HASH_BITS); i++)
+    {
+      _hash[i] = _hash[i] != NO_POSITION && _hash[i] >= shift ? _hash[i] - shift : NO_POSITION;
+    }
+  }
+
+  uint16_t length = _payload->read(_buffer + _end, BUFFER_SIZE - _end);
+  for (uint16_t i = 0; i < length; i++)
+  {
+    uint8_t ch = _buffer[_end + i];
+    _crc = (_crc >> 4) ^ pgm_read_dword(&CRC_NIBBLES[(_crc ^ ch) & 0x0F]);
+    _crc = (_crc >> 4) ^ pgm_read_dword(&CRC_NIBBLES[(_crc ^ (ch >> 4)) & 0x0F]);
+  }
+  _end += length;
+  _inputSize += length;
+}
+
+uint16_t GzipPayload::hash(uint16_t position)
+{
+  uint32_t key = _buffer[position] | (_buffer[position + 1] << 8) | ((uint32_t)_buffer[position + 2] << 16);
+  return (key * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Remember a position inside a match, so later matches can start there.
+void GzipPayload::insert(uint16_t position)
+{
+  if (position + MIN_MATCH <= _end)
+  {
+    _hash[hash(position)] = position;
+  }
+}
+
+// Deflate bits go out least significant first.
+void GzipPayload::writeBits(uint32_t value, uint8_t count)
+{
+  _bits |= value << _bitCount;
+  _bitCount += count;
+
+  while (_bitCount >= 8)
+  {
+    _out[_outLen++] = _bits & 0xFF;
+    _bits >>= 8;
+    _bitCount -= 8;
+  }
+}
+
+// A literal/length symbol with its fixed Huffman code. Huffman codes go out
+// most significant bit first, so they're reversed for writeBits().
+void GzipPayload::writeSymbol(uint16_t symbol)
+{
+  if (symbol < 144)
+  {
+    writeBits(reverseBits(0x30 + symbol, 8), 8);
+  }
+  else if (symbol < 256)
+  {
+    writeBits(reverseBits(0x190 + symbol - 144, 9), 9);
+  }
+  else if (symbol < 280)
+  {
+    writeBits(reverseBits(symbol - 256, 7), 7);
+  }
+  else
+  {
+    writeBits(reverseBits(0xC0 + symbol - 280, 8), 8);
+  }
+}
+
+void GzipPayload::writeMatch(uint16_t length, uint16_t distance)
+{
+  uint8_t code = 0;
+  while (code < 28 && pgm_read_word(&LENGTH_BASE[code + 1]) <= length)
+  {
+    code++;
+  }
+  writeSymbol(257 + code);
+  writeBits(length - pgm_read_word(&LENGTH_BASE[code]), pgm_read_byte(&LENGTH_EXTRA[code]));
+
+  code = 0;
+  while (code < 29 && pgm_read_word(&DISTANCE_BASE[code + 1]) <= distance)
+  {
+    code++;
+  }
+  writeBits(reverseBits(code, 5), 5);
+  writeBits(distance - pgm_read_word(&DISTANCE_BASE[code]), pgm_read_byte(&DISTANCE_EXTRA[code]));
+}
+
+// Whole bytes of the trailer, once the bits are aligned.
+void GzipPayload::writeByte(uint8_t value)
+{
+  _out[_outLen++] = value;
+}
@@ -0,0 +1,69 @@
+#ifndef GZIP_PAYLOAD_H
+#define GZIP_PAYLOAD_H
+
+#include "Stream.h"
+#include "MeasurementPayload.h"
+
+// A MeasurementPayload compressed to gzip while it is read, for sending with
+// Content-Encoding: gzip. Deflate with the fixed Huffman codes, matches found
+// through a single entry hash table over a WINDOW_SIZE history, all in
+// statically sized buffers (about 2.6 KB, so best allocated only while a
+// report is sent). size() comes from compressing the payload once up front in
+// begin(), so sending costs two compression passes.
+class GzipPayload : public Stream
+{
+  public:
+    static constexpr uint16_t WINDOW_SIZE = 1024;
+
+    void begin(MeasurementPayload& payload);
+    void rewind();
+    size_t size();
+
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t length) override;
+    size_t readBytes(char* buffer, size_t length) override;
+    int peek() override;
+    size_t write(uint8_t ch) override;
+
+  private:
+    static constexpr uint16_t MIN_MATCH = 3;
+    static constexpr uint16_t MAX_MATCH = 258;
+    static constexpr uint16_t BUFFER_SIZE = WINDOW_SIZE + 2 * MAX_MATCH;
+    static constexpr uint8_t HASH_BITS = 9;
+    static constexpr uint16_t NO_POSITION = 0xFFFF;
+
+    enum STATE { STATE_HEADER, STATE_DATA, STATE_TRAILER, STATE_DONE };
+
+    MeasurementPayload* _payload = nullptr;
+    size_t _size = 0;
+    size_t _position;
+    STATE _state;
+
+    // Input: history before _pos, lookahead from _pos to _end
+    uint8_t _buffer[BUFFER_SIZE];
+    uint16_t _pos;
+    uint16_t _end;
+    uint16_t _hash[1 << HASH_BITS];
+    uint32_t _crc;
+    uint32_t _inputSize;
+
+    // Output: bits not yet making up a byte, and bytes not yet read
+    uint32_t _bits;
+    uint8_t _bitCount;
+    uint8_t _out[16];
+    uint8_t _outLen;
+    uint8_t _outPos;
+
+    bool next();
+    void produce();
+    void fill();
+    uint16_t hash(uint16_t position);
+    void insert(uint16_t position);
+    void writeBits(uint32_t value, uint8_t count);
+    void writeSymbol(uint16_t symbol);
+    void writeMatch(uint16_t length, uint16_t distance);
+    void writeByte(uint8_t value);
+};
+
+#endif
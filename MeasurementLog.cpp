@@ -0,0 +1,325 @@
+#include "Arduino.h"
+#include "MeasurementLog.h"
+#include <coredecls.h>
+
+static_assert(PageBuffer::PAGE_SIZE % sizeof(MeasurementLog::RECORD) == 0, "Records must not straddle pages");
+static_assert(MeasurementLog::SEGMENT_SIZE % PageBuffer::PAGE_SIZE == 0, "Segments must be whole pages");
+
+MeasurementLog::MeasurementLog(FS& fs, const char* dir, uint32_t maxSize)
+{
+  _fs = &fs;
+  strncpy(_dir, dir, sizeof(_dir) - 1);
+  _dir[sizeof(_dir) - 1] = '\0';
+  _maxSegments = max(maxSize / SEGMENT_SIZE, (uint32_t)1);
+}
+
+// Pick up the segments and read position left by a previous boot. Call once
+// the file system is mounted.
+void MeasurementLog::begin()
+{
+  uint32_t records = 0;
+  bool found = false;
+
+  _fs->mkdir(_dir);
+  Dir dir = _fs->openDir(_dir);
+  while (dir.next())
+  {
+    String name = dir.fileName();
+    char* end;
+    uint32_t segment = strtoul(name.c_str(), &end, 10);
+    if (end == name.c_str() || *end != '\0')
+    {
+      continue;
+    }
+
+    records += dir.fileSize() / sizeof(RECORD);
+    if (!found || segment < _tail)
+    {
+      _tail = segment;
+    }
+    if (!found || segment >= _head)
+    {
+      _head = segment + 1;
+      _headSize = dir.fileSize();
+    }
+    found = true;
+  }
+
+  // A torn write leaves a partial record at the end, start a new segment
+  // rather than append after it
+  if (_headSize % sizeof(RECORD) != 0)
+  {
+    _headSize = SEGMENT_SIZE;
+  }
+
+  char path[24];
+  snprintf(path, sizeof(path), "%s/cursor", _dir);
+  File file = _fs->open(path, "r");
+  CURSOR cursor;
+  if (found && file && file.read((uint8_t*)&cursor, sizeof(cursor)) == sizeof(cursor)
+      && cursor.segment == _tail && cursor.offset % sizeof(RECORD) == 0)
+  {
+    _offset = cursor.offset;
+  }
+  file.close();
+
+  _count = records - min(records, _offset / (uint32_t)sizeof(RECORD));
+}
+
+// Buffer one reading; flash is only written once a page is full.
+void MeasurementLog::append(const MeasurementQueue::MEASUREMENT& measurement)
+{
+  RECORD record;
+  memset(&record, 0, sizeof(record));
+  record.measurement = measurement;
+  record.crc = crc32(&record.measurement, sizeof(record.measurement));
+
+  // Records divide pages evenly, so one always fits
+  _page.append(&record, sizeof(record), _headSize);
+  _count++;
+
+  if (_page.full(_headSize))
+  {
+    write();
+  }
+}
+
+// Put the buffered readings on flash, so a reset or deep sleep doesn't lose
+// them.
+void MeasurementLog::flush()
+{
+  if (_page.length() > 0)
+  {
+    write();
+  }
+}
+
+// Get up to `count` of the oldest readings without removing them; consume()
+// removes them once they've been delivered. Corrupted records are skipped.
+uint8_t MeasurementLog::read(MeasurementQueue::MEASUREMENT* measurements, uint8_t count)
+{
+  count = min(count, (uint8_t)MAX_READ);
+  _readCount = 0;
+  _readFromPage = false;
+
+  while (_tail != _head)
+  {
+    char path[24];
+    segmentPath(path, sizeof(path), _tail);
+    File file = _fs->open(path, "r");
+    uint32_t size = file ? file.size() : 0;
+    uint32_t offset = _offset;
+    RECORD record;
+
+    if (file && file.seek(offset))
+    {
+      while (_readCount < count && offset + sizeof(record) <= size
+             && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record))
+      {
+        if (crc32(&record.measurement, sizeof(record.measurement)) != record.crc)
+        {
+          // Hand out what we have so far, the bad record is skipped for good
+          // once it's the first one left
+          if (_readCount > 0)
+          {
+            break;
+          }
+          offset += sizeof(record);
+          _offset = offset;
+          _corrupted++;
+          _count -= min(_count, (uint32_t)1);
+          continue;
+        }
+
+        offset += sizeof(record);
+        measurements[_readCount] = record.measurement;
+        _readEnd[_readCount++] = offset;
+      }
+    }
+    file.close();
+
+    // Move on to the next segment once this one is used up, the one being
+    // appended to stays
+    if (_readCount > 0 || _tail + 1 == _head)
+    {
+      break;
+    }
+    removeTail();
+    saveCursor();
+  }
+
+  // Flash is used up, go on with the readings that haven't been written yet
+  if (_readCount == 0 && (_tail == _head || (_tail + 1 == _head && _offset >= _headSize)))
+  {
+    const uint8_t* buffered = _page.data();
+    uint16_t offset = 0;
+    RECORD record;
+
+    while (_readCount < count && offset + sizeof(record) <= _page.length())
+    {
+      memcpy(&record, buffered + offset, sizeof(record));
+      offset += sizeof(record);
+      measurements[_readCount] = record.measurement;
+      _readEnd[_readCount++] = offset;
+    }
+    _readFromPage = _readCount > 0;
+  }
+
+  return _readCount;
+}
+
+// Remove the first `count` readings returned by the last read().
+void MeasurementLog::consume(uint8_t count)
+{
+  count = min(count, _readCount);
+  if (count == 0)
+  {
+    return;
+  }
+
+  // Readings from the page buffer don't move the cursor on flash
+  bool moved = !_readFromPage;
+  if (_readFromPage)
+  {
+    _page.discard(_readEnd[count - 1]);
+  }
+  else
+  {
+    _offset = _readEnd[count - 1];
+  }
+  _count -= min(_count, (uint32_t)count);
+  _readCount = 0;
+  _readFromPage = false;
+
+  // Everything delivered, start over with an empty directory
+  if (_tail + 1 == _head && _offset >= _headSize && _page.length() == 0)
+  {
+    removeTail();
+    moved = true;
+  }
+  if (moved)
+  {
+    saveCursor();
+  }
+}
+
+// Readings waiting to be sent, buffered ones included.
+uint32_t MeasurementLog::count()
+{
+  return _count;
+}
+
+// Readings lost to the size limit or failed writes.
+uint32_t MeasurementLog::dropped()
+{
+  return _dropped;
+}
+
+// Records skipped for a bad CRC.
+uint32_t MeasurementLog::corrupted()
+{
+  return _corrupted;
+}
+
+void MeasurementLog::write()
+{
+  uint8_t readCount = _readCount;
+  if (_tail == _head || _headSize >= SEGMENT_SIZE)
+  {
+    _head++;
+    _headSize = 0;
+
+    // Over the size limit, sacrifice the oldest readings
+    if (_head - _tail > _maxSegments)
+    {
+      char path[24];
+      segmentPath(path, sizeof(path), _tail);
+      File file = _fs->open(path, "r");
+      uint32_t size = file ? file.size() : 0;
+      file.close();
+
+      uint32_t lost = size / sizeof(RECORD) - min(size, _offset) / (uint32_t)sizeof(RECORD);
+      _dropped += lost;
+      _count -= min(_count, lost);
+      removeTail();
+      saveCursor();
+    }
+  }
+
+  char path[24];
+  segmentPath(path, sizeof(path), _head - 1);
+  uint16_t length = _page.length();
+  uint32_t start = _headSize;
+  size_t written = _page.writeTo(*_fs, path);
+
+  // Readings handed out from the buffer but not consumed yet are on flash
+  // now, at the start of what was written. Everything before them has been
+  // read, or read() wouldn't have gone to the buffer.
+  if (_readFromPage)
+  {
+    while (_tail + 1 < _head)
+    {
+      removeTail();
+    }
+    _offset = start;
+    _readCount = written >= _readEnd[readCount - 1] ? readCount : 0;
+    for (uint8_t i = 0; i < _readCount; i++)
+    {
+      _readEnd[i] += start;
+    }
+    _readFromPage = false;
+  }
+
+  uint32_t lost = length / sizeof(RECORD) - written / sizeof(RECORD);
+  _dropped += lost;
+  _count -= min(_count, lost);
+  _headSize += written;
+  if (written % sizeof(RECORD) != 0)
+  {
+    _headSize = SEGMENT_SIZE;
+  }
+}
+
+void MeasurementLog::removeTail()
+{
+  char path[24];
+  segmentPath(path, sizeof(path), _tail);
+  _fs->remove(path);
+
+  _tail++;
+  _offset = 0;
+  _readCount = 0;
+  if (_tail == _head)
+  {
+    _headSize = 0;
+  }
+}
+
+// Only written when readings are consumed, once per delivered batch.
+void MeasurementLog::saveCursor()
+{
+  char path[24];
+  snprintf(path, sizeof(path), "%s/cursor", _dir);
+
+  if (_offset == 0)
+  {
+    if (_fs->exists(path))
+    {
+      _fs->remove(path);
+    }
+    return;
+  }
+
+  CURSOR cursor = { _tail, _offset };
+  File file = _fs->open(path, "w");
+  if (file)
+  {
+    file.write((const uint8_t*)&cursor, sizeof(cursor));
+  }
+  file.close();
+}
+
+void MeasurementLog::segmentPath(char* path, size_t size, uint32_t segment)
+{
+  snprintf(path, size, "%s/%u", _dir, segment);
+}
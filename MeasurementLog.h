@@ -0,0 +1,72 @@
+#ifndef MEASUREMENT_LOG_H
+#define MEASUREMENT_LOG_H
+
+#include <FS.h>
+#include "MeasurementQueue.h"
+#include "PageBuffer.h"
+
+// Readings that couldn't be reported, kept on flash until they can. Records
+// carry a CRC and are appended to numbered segment files in a directory,
+// buffered and written in whole flash pages. Once more than `maxSize` bytes of
+// segments exist the oldest one is dropped. The read position is kept in
+// `<dir>/cursor`, so a reboot doesn't resend what was already delivered.
+// Readings still in the page buffer are read from there, so ones delivered
+// before their page is full never reach flash.
+class MeasurementLog
+{
+  public:
+    static const uint16_t SEGMENT_SIZE = 4096;
+    static const uint8_t MAX_READ = MeasurementQueue::CAPACITY;
+
+    struct RECORD {
+      MeasurementQueue::MEASUREMENT measurement;
+      uint32_t crc;         // crc32() of measurement
+    };
+
+    MeasurementLog(FS& fs, const char* dir, uint32_t maxSize);
+    void begin();
+    void append(const MeasurementQueue::MEASUREMENT& measurement);
+    void flush();
+
+    uint8_t read(MeasurementQueue::MEASUREMENT* measurements, uint8_t count);
+    void consume(uint8_t count);
+
+    uint32_t count();
+    uint32_t dropped();
+    uint32_t corrupted();
+
+  private:
+    struct CURSOR {
+      uint32_t segment;
+      uint32_t offset;
+    };
+
+    FS* _fs;
+    char _dir[16];
+    uint32_t _maxSegments;
+
+    // Segments [_tail, _head) exist, _head - 1 is being appended to
+    uint32_t _tail = 0;
+    uint32_t _head = 0;
+    uint32_t _headSize = 0;
+    uint32_t _offset = 0;         // Read position in segment _tail
+
+    uint32_t _count = 0;
+    uint32_t _dropped = 0;
+    uint32_t _corrupted = 0;
+
+    PageBuffer _page;
+
+    // Offsets in segment _tail, or in _page if _readFromPage, right after
+    // each record returned by read()
+    uint16_t _readEnd[MAX_READ];
+    uint8_t _readCount = 0;
+    bool _readFromPage = false;
+
+    void write();
+    void removeTail();
+    void saveCursor();
+    void segmentPath(char* path, size_t size, uint32_t segment);
+};
+
+#endif
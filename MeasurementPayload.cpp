@@ -0,0 +1,483 @@
+#include "Arduino.h"
+#include "MeasurementPayload.h"
+
+// The document is a header, a separator and the patched skeleton for each
+// reading, and a footer.
+static const uint16_t PIECES_PER_READING = 2;
+
+// In FORMAT_COLUMNS, the skeleton is followed by one column per key, each
+// closed by its key's literal: recorded_deltas, then the values
+static const char* const COLUMN_ENDS[] = {
+  "],\"pm1dot0\": [",
+  "],\"pm2dot5\": [",
+  "],\"pm10\": [",
+  "]}",
+};
+static const uint8_t COLUMNS = sizeof(COLUMN_ENDS) / sizeof(COLUMN_ENDS[0]);
+
+// CBOR major types, in the top three bits of the initial byte
+static const uint8_t CBOR_UNSIGNED = 0x00;
+static const uint8_t CBOR_TEXT = 0x60;
+static const uint8_t CBOR_ARRAY = 0x80;
+static const uint8_t CBOR_MAP = 0xA0;
+static const uint8_t CBOR_TAG = 0xC0;
+static const uint8_t CBOR_SIMPLE = 0xE0;
+
+// Additional information for arguments following the initial byte
+static const uint8_t CBOR_UINT8 = 24;
+static const uint8_t CBOR_UINT16 = 25;
+static const uint8_t CBOR_UINT32 = 26;
+static const uint8_t CBOR_FLOAT32 = 26;
+static const uint8_t CBOR_NULL = 22;
+static const uint8_t CBOR_EPOCH_TAG = 1;
+
+// Render a reading's object with everything that only changes with the
+// configuration. Call again whenever any of these change.
+void MeasurementPayload::setDevice(const char* sensor, const char* source, const char* version,
+                                   const char* description, const char* longitude, const char* latitude,
+                                   FORMAT format)
+{
+  _format = format;
+  _skeletonLen = 0;
+
+  if (FORMAT_CBOR == _format)
+  {
+    _reserved = 3 * 2 + 4;
+    appendByte(CBOR_MAP | CBOR_KEYS);
+    appendCborText(CBOR_SENSOR, sensor);
+    appendCborText(CBOR_SOURCE, source);
+    appendCborText(CBOR_VERSION, version);
+    appendCborText(CBOR_DESCRIPTION, description);
+    appendByte(CBOR_UNSIGNED | CBOR_PM1_0);
+    appendByte(CBOR_UNSIGNED | CBOR_UINT16);
+    appendSlot(SLOT_PM1_0, 2);
+    appendByte(CBOR_UNSIGNED | CBOR_PM2_5);
+    appendByte(CBOR_UNSIGNED | CBOR_UINT16);
+    appendSlot(SLOT_PM2_5, 2);
+    appendByte(CBOR_UNSIGNED | CBOR_PM10_0);
+    appendByte(CBOR_UNSIGNED | CBOR_UINT16);
+    appendSlot(SLOT_PM10_0, 2);
+    appendCborFloat(CBOR_LONGITUDE, longitude);
+    appendCborFloat(CBOR_LATITUDE, latitude);
+    appendByte(CBOR_UNSIGNED | CBOR_RECORDED);
+    appendByte(CBOR_TAG | CBOR_EPOCH_TAG);
+    appendByte(CBOR_UNSIGNED | CBOR_UINT32);
+    appendSlot(SLOT_RECORDED, 4);
+
+    _separator = "";
+    _footer = "";
+    return;
+  }
+
+  if (FORMAT_COLUMNS == _format)
+  {
+    _reserved = Timestamp::ISO8601_LENGTH;
+    append("{\"sensor\": \"");
+    append(sensor, true);
+    append("\",\"source\": \"");
+    append(source, true);
+    append("\",\"version\": \"");
+    append(version, true);
+    append("\",\"description\": \"");
+    append(description, true);
+    append("\",\"longitude\": ");
+    append(longitude);
+    append(",\"latitude\": ");
+    append(latitude);
+    append(",\"recorded\": \"");
+    appendSlot(SLOT_RECORDED, Timestamp::ISO8601_LENGTH);
+    append("\",\"recorded_deltas\": [");
+    return;
+  }
+
+  _reserved = 3 * NUMBER_WIDTH + Timestamp::ISO8601_LENGTH;
+  append("{\"sensor\": \"");
+  append(sensor, true);
+  append("\",\"source\": \"");
+  append(source, true);
+  append("\",\"version\": \"");
+  append(version, true);
+  append("\",\"description\": \"");
+  append(description, true);
+  append("\",\"pm1dot0\": ");
+  appendSlot(SLOT_PM1_0, NUMBER_WIDTH);
+  append(",\"pm2dot5\": ");
+  appendSlot(SLOT_PM2_5, NUMBER_WIDTH);
+  append(",\"pm10\": ");
+  appendSlot(SLOT_PM10_0, NUMBER_WIDTH);
+  append(",\"longitude\": ");
+  append(longitude);
+  append(",\"latitude\": ");
+  append(latitude);
+  append(",\"recorded\": \"");
+  appendSlot(SLOT_RECORDED, Timestamp::ISO8601_LENGTH);
+  append("\"}");
+
+  _separator = ",";
+  _footer = "]";
+}
+
+const char* MeasurementPayload::contentType()
+{
+  return FORMAT_CBOR == _format ? "application/cbor" : "application/json";
+}
+
+// The same as a CoAP Content-Format number (RFC 7252, 12.3)
+uint16_t MeasurementPayload::contentFormat()
+{
+  return FORMAT_CBOR == _format ? 60 : 50;
+}
+
+// Serialize the `count` oldest readings of `queue`, which must not change
+// until the payload has been read.
+void MeasurementPayload::begin(const MeasurementQueue& queue, uint8_t count)
+{
+  _queue = &queue;
+  _count = min(count, queue.count());
+
+  if (FORMAT_CBOR == _format)
+  {
+    _headerLen = 0;
+    if (_count < CBOR_UINT8)
+    {
+      _header[_headerLen++] = CBOR_ARRAY | _count;
+    }
+    else
+    {
+      _header[_headerLen++] = CBOR_ARRAY | CBOR_UINT8;
+      _header[_headerLen++] = _count;
+    }
+  }
+  else
+  {
+    _header[0] = '[';
+    _headerLen = 1;
+  }
+
+  if (FORMAT_COLUMNS == _format)
+  {
+    // Counting pass, the columns' numbers vary in length
+    _patched = 0xFF;
+    _size = 0;
+    uint16_t length;
+    for (uint16_t index = 0; columnPiece(index, length) != nullptr; index++)
+    {
+      _size += length;
+    }
+
+    rewind();
+    return;
+  }
+
+  // All readings render to the same length
+  _size = _headerLen + _count * _skeletonLen + strlen(_footer);
+  if (_count > 1)
+  {
+    _size += (_count - 1) * strlen(_separator);
+  }
+
+  rewind();
+}
+
+// Start reading from the beginning again, e.g. to retry a request.
+void MeasurementPayload::rewind()
+{
+  _patched = 0xFF;
+  _piece = 0;
+  _pieceData = piece(0, _pieceLen);
+  _piecePos = 0;
+  _position = 0;
+}
+
+size_t MeasurementPayload::size()
+{
+  return _size;
+}
+
+int MeasurementPayload::available()
+{
+  return _size - _position;
+}
+
+int MeasurementPayload::read()
+{
+  if (!next())
+  {
+    return -1;
+  }
+
+  _position++;
+  return (uint8_t)_pieceData[_piecePos++];
+}
+
+int MeasurementPayload::read(uint8_t* buffer, size_t length)
+{
+  size_t copied = 0;
+
+  while (copied < length && next())
+  {
+    size_t chunk = min(length - copied, (size_t)(_pieceLen - _piecePos));
+    memcpy(buffer + copied, _pieceData + _piecePos, chunk);
+    _piecePos += chunk;
+    _position += chunk;
+    copied += chunk;
+  }
+
+  return copied;
+}
+
+size_t MeasurementPayload::readBytes(char* buffer, size_t length)
+{
+  return read((uint8_t*)buffer, length);
+}
+
+int MeasurementPayload::peek()
+{
+  if (!next())
+  {
+    return -1;
+  }
+
+  return (uint8_t)_pieceData[_piecePos];
+}
+
+size_t MeasurementPayload::write(uint8_t /* ch */)
+{
+  return 0;
+}
+
+// Make sure there is something left to read in the current piece, moving on
+// to the next non-empty one if needed. False at the end of the document.
+bool MeasurementPayload::next()
+{
+  while (_pieceData != nullptr && _piecePos == _pieceLen)
+  {
+    _pieceData = piece(++_piece, _pieceLen);
+    _piecePos = 0;
+  }
+
+  return _pieceData != nullptr;
+}
+
+// Piece `index` of the document and its length, nullptr past the end.
+const char* MeasurementPayload::piece(uint16_t index, uint16_t& length)
+{
+  if (FORMAT_COLUMNS == _format)
+  {
+    return columnPiece(index, length);
+  }
+
+  if (index == 0)
+  {
+    length = _headerLen;
+    return _header;
+  }
+
+  uint8_t reading = (index - 1) / PIECES_PER_READING;
+  if (reading >= _count)
+  {
+    const char* data = index == 1 + _count * PIECES_PER_READING ? _footer : nullptr;
+    length = data != nullptr ? strlen(data) : 0;
+    return data;
+  }
+
+  if ((index - 1) % PIECES_PER_READING == 0)
+  {
+    const char* data = reading == 0 ? "" : _separator;
+    length = strlen(data);
+    return data;
+  }
+
+  patch(reading);
+  length = _skeletonLen;
+  return _skeleton;
+}
+
+// Piece `index` of a FORMAT_COLUMNS document: the skeleton with the time of
+// the first reading, then a value per reading and the end of each column.
+const char* MeasurementPayload::columnPiece(uint16_t index, uint16_t& length)
+{
+  if (index == 0)
+  {
+    if (_count > 0)
+    {
+      patch(0);
+    }
+    length = _skeletonLen;
+    return _skeleton;
+  }
+
+  uint8_t column = (index - 1) / (_count + 1);
+  uint8_t reading = (index - 1) % (_count + 1);
+  if (column >= COLUMNS)
+  {
+    length = 0;
+    return nullptr;
+  }
+
+  if (reading == _count)
+  {
+    length = strlen(COLUMN_ENDS[column]);
+    return COLUMN_ENDS[column];
+  }
+
+  const MeasurementQueue::MEASUREMENT& measurement = _queue->at(reading);
+  int32_t value;
+  switch (column)
+  {
+    case 0:
+      value = reading == 0 ? 0 : (int32_t)(measurement.recorded - _queue->at(reading - 1).recorded);
+      break;
+    case 1: value = measurement.pm1p0; break;
+    case 2: value = measurement.pm2p5; break;
+    default: value = measurement.pm10p0; break;
+  }
+
+  length = 0;
+  if (reading > 0)
+  {
+    _scratch[length++] = ',';
+  }
+  if (value < 0)
+  {
+    _scratch[length++] = '-';
+    value = -value;
+  }
+
+  uint8_t digits = 1;
+  for (uint32_t rest = value; rest >= 10; rest /= 10)
+  {
+    digits++;
+  }
+  Timestamp::formatNumber(_scratch + length, digits, value);
+  length += digits;
+  return _scratch;
+}
+
+// Fill the slots of the skeleton with the values of `reading`.
+void MeasurementPayload::patch(uint8_t reading)
+{
+  if (reading == _patched)
+  {
+    return;
+  }
+  _patched = reading;
+
+  const MeasurementQueue::MEASUREMENT& measurement = _queue->at(reading);
+  if (FORMAT_COLUMNS == _format)
+  {
+    _timestamp.formatIso8601(_skeleton + _slots[SLOT_RECORDED], measurement.recorded);
+    return;
+  }
+
+  if (FORMAT_CBOR == _format)
+  {
+    uint16_t values[] = { measurement.pm1p0, measurement.pm2p5, measurement.pm10p0 };
+    for (uint8_t slot = SLOT_PM1_0; slot <= SLOT_PM10_0; slot++)
+    {
+      _skeleton[_slots[slot]] = values[slot] >> 8;
+      _skeleton[_slots[slot] + 1] = values[slot] & 0xFF;
+    }
+
+    char* recorded = _skeleton + _slots[SLOT_RECORDED];
+    recorded[0] = measurement.recorded >> 24;
+    recorded[1] = (measurement.recorded >> 16) & 0xFF;
+    recorded[2] = (measurement.recorded >> 8) & 0xFF;
+    recorded[3] = measurement.recorded & 0xFF;
+    return;
+  }
+
+  Timestamp::formatNumber(_skeleton + _slots[SLOT_PM1_0], NUMBER_WIDTH, measurement.pm1p0, ' ');
+  Timestamp::formatNumber(_skeleton + _slots[SLOT_PM2_5], NUMBER_WIDTH, measurement.pm2p5, ' ');
+  Timestamp::formatNumber(_skeleton + _slots[SLOT_PM10_0], NUMBER_WIDTH, measurement.pm10p0, ' ');
+  _timestamp.formatIso8601(_skeleton + _slots[SLOT_RECORDED], measurement.recorded);
+}
+
+// Add text to the skeleton, escaped as the contents of a JSON string if
+// `escape` is set. Whatever doesn't fit next to the slots still to come is cut
+// off, which the portal's field lengths never lead to.
+void MeasurementPayload::append(const char* text, bool escape)
+{
+  size_t room = sizeof(_skeleton) - _reserved;
+
+  for (; *text != '\0'; text++)
+  {
+    char ch = *text;
+    if (escape && (uint8_t)ch < ' ')
+    {
+      continue;
+    }
+
+    if (escape && (ch == '"' || ch == '\\') && _skeletonLen < room)
+    {
+      _skeleton[_skeletonLen++] = '\\';
+    }
+    if (_skeletonLen < room)
+    {
+      _skeleton[_skeletonLen++] = ch;
+    }
+  }
+}
+
+// Add a single byte, e.g. a CBOR initial byte, if there is room for it.
+void MeasurementPayload::appendByte(uint8_t value)
+{
+  if (_skeletonLen < sizeof(_skeleton) - _reserved)
+  {
+    _skeleton[_skeletonLen++] = value;
+  }
+}
+
+// Add a CBOR text string under `key`.
+void MeasurementPayload::appendCborText(CBOR_KEY key, const char* text)
+{
+  size_t length = min(strlen(text), (size_t)0xFF);
+
+  appendByte(CBOR_UNSIGNED | key);
+  if (length < CBOR_UINT8)
+  {
+    appendByte(CBOR_TEXT | length);
+  }
+  else
+  {
+    appendByte(CBOR_TEXT | CBOR_UINT8);
+    appendByte(length);
+  }
+  for (size_t i = 0; i < length; i++)
+  {
+    appendByte(text[i]);
+  }
+}
+
+// Add a number given as text, e.g. a coordinate from the portal, as a CBOR
+// single precision float under `key`, or null if it isn't a number.
+void MeasurementPayload::appendCborFloat(CBOR_KEY key, const char* text)
+{
+  char* end;
+  float value = strtod(text, &end);
+
+  appendByte(CBOR_UNSIGNED | key);
+  if (end == text)
+  {
+    appendByte(CBOR_SIMPLE | CBOR_NULL);
+    return;
+  }
+
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  appendByte(CBOR_SIMPLE | CBOR_FLOAT32);
+  appendByte(bits >> 24);
+  appendByte((bits >> 16) & 0xFF);
+  appendByte((bits >> 8) & 0xFF);
+  appendByte(bits & 0xFF);
+}
+
+// Add `width` characters for a value patched in per reading. Room for them
+// was kept by append().
+void MeasurementPayload::appendSlot(SLOT slot, uint8_t width)
+{
+  _reserved -= width;
+  _slots[slot] = _skeletonLen;
+  memset(_skeleton + _skeletonLen, ' ', width);
+  _skeletonLen += width;
+}
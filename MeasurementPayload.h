@@ -0,0 +1,98 @@
+#ifndef MEASUREMENT_PAYLOAD_H
+#define MEASUREMENT_PAYLOAD_H
+
+#include "Stream.h"
+#include "MeasurementQueue.h"
+#include "Timestamp.h"
+
+// The body of a report, generated piece by piece while it is read, so a
+// batch of any size is sent straight from the queue without a payload buffer
+// or heap allocation. Hand it to HTTPClient::sendRequest() along with size()
+// and contentType().
+//
+// A reading's object is rendered once by setDevice(), with fixed width slots
+// for the values that change, and for each reading only those slots are
+// patched. Numbers are right aligned in their slot with spaces, which JSON
+// allows, so every reading has the same length.
+//
+// FORMAT_COLUMNS sends a batch as one JSON object instead: the device fields
+// once, the first reading's time plus the seconds between readings, and an
+// array per value.
+//
+// FORMAT_CBOR sends the same array as CBOR (RFC 8949) maps with the integer
+// keys of CBOR_KEY, epoch timestamps and coordinates as floats. Values are
+// always encoded at full width (uint16, uint32), which keeps the slots fixed
+// and is valid, if not the shortest, CBOR.
+class MeasurementPayload : public Stream
+{
+  public:
+    enum FORMAT { FORMAT_JSON, FORMAT_CBOR, FORMAT_COLUMNS };
+
+    enum CBOR_KEY {
+      CBOR_SENSOR, CBOR_SOURCE, CBOR_VERSION, CBOR_DESCRIPTION,
+      CBOR_PM1_0, CBOR_PM2_5, CBOR_PM10_0,
+      CBOR_LONGITUDE, CBOR_LATITUDE, CBOR_RECORDED, CBOR_KEYS
+    };
+
+    void setDevice(const char* sensor, const char* source, const char* version,
+                   const char* description, const char* longitude, const char* latitude,
+                   FORMAT format = FORMAT_JSON);
+    const char* contentType();
+    uint16_t contentFormat();
+    void begin(const MeasurementQueue& queue, uint8_t count);
+    void rewind();
+    size_t size();
+
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t length) override;
+    size_t readBytes(char* buffer, size_t length) override;
+    int peek() override;
+    size_t write(uint8_t ch) override;
+
+  private:
+    static const uint8_t NUMBER_WIDTH = 5;      // Up to 65535
+
+    enum SLOT { SLOT_PM1_0, SLOT_PM2_5, SLOT_PM10_0, SLOT_RECORDED, SLOTS };
+
+    FORMAT _format = FORMAT_JSON;
+
+    // Array header, e.g. "[", and the separator between readings
+    char _header[3];
+    uint8_t _headerLen;
+    const char* _separator;
+    const char* _footer;
+
+    // One reading's object, with the offsets of its slots
+    char _skeleton[320];
+    uint16_t _skeletonLen = 0;
+    uint16_t _slots[SLOTS];
+    uint8_t _reserved;            // Width of the slots not added yet
+    uint8_t _patched;             // Reading the slots were last patched for
+    Timestamp _timestamp;
+    char _scratch[12];            // A column value and its separator
+
+    const MeasurementQueue* _queue = nullptr;
+    uint8_t _count = 0;
+    size_t _size = 0;
+
+    // Position: piece _piece of the document, _pieceLen bytes at _pieceData,
+    // _piecePos of them already read
+    uint16_t _piece;
+    const char* _pieceData;
+    uint16_t _pieceLen;
+    uint16_t _piecePos;
+    size_t _position;
+
+    void append(const char* text, bool escape = false);
+    void appendByte(uint8_t value);
+    void appendCborText(CBOR_KEY key, const char* text);
+    void appendCborFloat(CBOR_KEY key, const char* text);
+    void appendSlot(SLOT slot, uint8_t width);
+    void patch(uint8_t reading);
+    const char* piece(uint16_t index, uint16_t& length);
+    const char* columnPiece(uint16_t index, uint16_t& length);
+    bool next();
+};
+
+#endif
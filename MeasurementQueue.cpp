@@ -0,0 +1,38 @@
+#include "MeasurementQueue.h"
+
+// Add a reading. Returns false if the oldest reading had to be dropped.
+bool MeasurementQueue::push(const MEASUREMENT& measurement)
+{
+  bool dropped = _count == CAPACITY;
+  if (dropped)
+  {
+    pop(1);
+  }
+
+  _items[(_head + _count) % CAPACITY] = measurement;
+  _count++;
+  return !dropped;
+}
+
+// Remove the `count` oldest readings, e.g. once they've been reported.
+void MeasurementQueue::pop(uint8_t count)
+{
+  if (count > _count)
+  {
+    count = _count;
+  }
+
+  _head = (_head + count) % CAPACITY;
+  _count -= count;
+}
+
+// Reading `index` places after the oldest one.
+const MeasurementQueue::MEASUREMENT& MeasurementQueue::at(uint8_t index) const
+{
+  return _items[(_head + index) % CAPACITY];
+}
+
+uint8_t MeasurementQueue::count() const
+{
+  return _count;
+}
@@ -0,0 +1,31 @@
+#ifndef MEASUREMENT_QUEUE_H
+#define MEASUREMENT_QUEUE_H
+
+#include <stdint.h>
+
+// Readings waiting to be reported, oldest first. Fixed capacity: once full,
+// pushing a new reading drops the oldest one.
+class MeasurementQueue
+{
+  public:
+    static const uint8_t CAPACITY = 16;
+
+    struct MEASUREMENT {
+      uint32_t recorded;    // Epoch seconds
+      uint16_t pm1p0;
+      uint16_t pm2p5;
+      uint16_t pm10p0;
+    };
+
+    bool push(const MEASUREMENT& measurement);
+    void pop(uint8_t count);
+    const MEASUREMENT& at(uint8_t index) const;
+    uint8_t count() const;
+
+  private:
+    MEASUREMENT _items[CAPACITY];
+    uint8_t _head = 0;
+    uint8_t _count = 0;
+};
+
+#endif
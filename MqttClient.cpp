@@ -0,0 +1,320 @@
+#include "Arduino.h"
+#include "MqttClient.h"
+
+// Use `client` for the connection. It may only be changed while disconnected.
+void MqttClient::begin(Client& client)
+{
+  _client = &client;
+}
+
+// Open a clean session with the broker at host:port. `username` and
+// `password` may be null. Returns 0 once the broker has accepted it, its
+// CONNACK return code if it refused, or one of the errors.
+int MqttClient::connect(const char* host, uint16_t port, const char* clientId,
+                        const char* username, const char* password)
+{
+  if (_client == nullptr || !_client->connect(host, port))
+  {
+    return ERROR_CONNECTION;
+  }
+
+  // A password is only allowed along with a username
+  password = username != nullptr ? password : nullptr;
+  uint8_t flags = 0x02;
+  uint32_t length = 10 + 2 + strlen(clientId);
+  if (username != nullptr)
+  {
+    flags |= 0x80;
+    length += 2 + strlen(username);
+  }
+  if (password != nullptr)
+  {
+    flags |= 0x40;
+    length += 2 + strlen(password);
+  }
+
+  const uint8_t variable[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, flags, KEEP_ALIVE >> 8, KEEP_ALIVE & 0xFF };
+  if (!writeHeader(TYPE_CONNECT, 0, length) || !write(variable, sizeof(variable)) || !writeString(clientId)
+      || (username != nullptr && !writeString(username)) || (password != nullptr && !writeString(password)))
+  {
+    drop();
+    return ERROR_CONNECTION;
+  }
+
+  _connected = true;
+  _pingOutstanding = false;
+  int code = await(TYPE_CONNACK, 0);
+  if (code != 0)
+  {
+    drop();
+  }
+  return code;
+}
+
+bool MqttClient::connected()
+{
+  if (_connected && !_client->connected())
+  {
+    _connected = false;
+  }
+  return _connected;
+}
+
+// Publish `payload` on `topic` at QoS 1 and wait for the broker's PUBACK.
+// Returns 0 once it came, or one of the errors. On error the connection is
+// closed, as it is no longer known what the broker has seen.
+int MqttClient::publish(const char* topic, MeasurementPayload& payload)
+{
+  if (!connected())
+  {
+    return ERROR_CONNECTION;
+  }
+
+  // 0 is not a valid packet identifier
+  uint16_t packetId = ++_packetId == 0 ? ++_packetId : _packetId;
+  _retransmissions = 0;
+  while (true)
+  {
+    if (!writePublish(topic, payload, packetId, _retransmissions > 0))
+    {
+      drop();
+      return ERROR_CONNECTION;
+    }
+
+    int result = await(TYPE_PUBACK, packetId);
+    if (result != ERROR_TIMEOUT || _retransmissions == MAX_RETRANSMIT)
+    {
+      if (result != 0)
+      {
+        drop();
+      }
+      return result;
+    }
+    _retransmissions++;
+  }
+}
+
+// Call regularly: handles what the broker sends, pings it once KEEP_ALIVE
+// seconds have passed without sending anything, and closes the connection
+// if a ping goes unanswered.
+void MqttClient::loop()
+{
+  if (!connected())
+  {
+    return;
+  }
+
+  while (_client->available() > 0)
+  {
+    uint8_t type;
+    if (readPacket(type, nullptr, 0) < 0)
+    {
+      drop();
+      return;
+    }
+    if (TYPE_PINGRESP == type)
+    {
+      _pingOutstanding = false;
+    }
+  }
+
+  uint32_t time_now = millis();
+  if (_pingOutstanding)
+  {
+    if (time_now - _pingSent >= ACK_TIMEOUT)
+    {
+      drop();
+    }
+  }
+  else if (time_now - _lastSent >= KEEP_ALIVE * 1000UL)
+  {
+    if (!writeHeader(TYPE_PINGREQ, 0, 0))
+    {
+      drop();
+      return;
+    }
+    _pingOutstanding = true;
+    _pingSent = time_now;
+  }
+}
+
+void MqttClient::disconnect()
+{
+  if (connected())
+  {
+    writeHeader(TYPE_DISCONNECT, 0, 0);
+  }
+  drop();
+}
+
+// Times the last message was sent again for lack of a PUBACK.
+uint8_t MqttClient::retransmissions()
+{
+  return _retransmissions;
+}
+
+// Fixed header: type and flags, then the remaining length, 7 bits per byte.
+bool MqttClient::writeHeader(uint8_t type, uint8_t flags, uint32_t length)
+{
+  uint8_t header[5] = { (uint8_t)((type << 4) | flags) };
+  uint8_t size = 1;
+  do
+  {
+    header[size] = length & 0x7F;
+    length >>= 7;
+    header[size++] |= length > 0 ? 0x80 : 0;
+  } while (length > 0);
+
+  return write(header, size);
+}
+
+bool MqttClient::writeString(const char* text)
+{
+  uint16_t length = strlen(text);
+  uint8_t prefix[2] = { (uint8_t)(length >> 8), (uint8_t)(length & 0xFF) };
+  return write(prefix, sizeof(prefix)) && write((const uint8_t*)text, length);
+}
+
+bool MqttClient::write(const uint8_t* bytes, size_t length)
+{
+  if (_client->write(bytes, length) != length)
+  {
+    return false;
+  }
+  _lastSent = millis();
+  return true;
+}
+
+bool MqttClient::writePublish(const char* topic, MeasurementPayload& payload, uint16_t packetId, bool duplicate)
+{
+  uint8_t id[2] = { (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF) };
+  uint32_t length = 2 + strlen(topic) + sizeof(id) + payload.size();
+  if (!writeHeader(TYPE_PUBLISH, (duplicate ? 0x08 : 0) | 0x02, length) || !writeString(topic)
+      || !write(id, sizeof(id)))
+  {
+    return false;
+  }
+
+  uint8_t buffer[128];
+  int count;
+  payload.rewind();
+  while ((count = payload.read(buffer, sizeof(buffer))) > 0)
+  {
+    if (!write(buffer, count))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Wait up to ACK_TIMEOUT for a packet of `type`, for a PUBACK the one
+// acknowledging `packetId`. Returns 0, for a CONNACK its return code, or one
+// of the errors. Acknowledgements of earlier packets are skipped.
+int MqttClient::await(uint8_t type, uint16_t packetId)
+{
+  uint32_t start = millis();
+  while (millis() - start < ACK_TIMEOUT)
+  {
+    if (_client->available() == 0)
+    {
+      if (!_client->connected())
+      {
+        return ERROR_CONNECTION;
+      }
+      delay(1);
+      continue;
+    }
+
+    uint8_t received;
+    uint8_t body[2];
+    int length = readPacket(received, body, sizeof(body));
+    if (length < 0)
+    {
+      return length;
+    }
+
+    if (TYPE_PINGRESP == received)
+    {
+      _pingOutstanding = false;
+    }
+    if (received != type)
+    {
+      continue;
+    }
+
+    if (TYPE_CONNACK == type)
+    {
+      return length == 2 ? body[1] : ERROR_PROTOCOL;
+    }
+    if (length == 2 && ((body[0] << 8) | body[1]) == packetId)
+    {
+      return 0;
+    }
+  }
+
+  return ERROR_TIMEOUT;
+}
+
+// Read one packet, keeping up to `size` bytes of its body. Returns the type
+// and the body length, or one of the errors.
+int MqttClient::readPacket(uint8_t& type, uint8_t* body, uint8_t size)
+{
+  int ch = readByte();
+  if (ch < 0)
+  {
+    return ERROR_CONNECTION;
+  }
+  type = ch >> 4;
+
+  uint32_t length = 0;
+  uint8_t shift = 0;
+  do
+  {
+    if ((ch = readByte()) < 0 || shift > 21)
+    {
+      return ch < 0 ? ERROR_CONNECTION : ERROR_PROTOCOL;
+    }
+    length |= (uint32_t)(ch & 0x7F) << shift;
+    shift += 7;
+  } while (ch & 0x80);
+
+  for (uint32_t i = 0; i < length; i++)
+  {
+    if ((ch = readByte()) < 0)
+    {
+      return ERROR_CONNECTION;
+    }
+    if (i < size)
+    {
+      body[i] = ch;
+    }
+  }
+  return length;
+}
+
+// The next byte of a packet that has started arriving, or -1 if it doesn't
+// come within ACK_TIMEOUT.
+int MqttClient::readByte()
+{
+  uint32_t start = millis();
+  while (_client->available() == 0)
+  {
+    if (!_client->connected() || millis() - start >= ACK_TIMEOUT)
+    {
+      return -1;
+    }
+    delay(1);
+  }
+  return _client->read();
+}
+
+void MqttClient::drop()
+{
+  if (_client != nullptr)
+  {
+    _client->stop();
+  }
+  _connected = false;
+  _pingOutstanding = false;
+}
@@ -0,0 +1,58 @@
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <Client.h>
+#include "MeasurementPayload.h"
+
+// Publishes a MeasurementPayload to an MQTT 3.1.1 broker at QoS 1, over any
+// Arduino Client, plain or TLS. The message is streamed from the payload
+// instead of being built in a buffer. publish() waits for the broker's
+// PUBACK and, if none comes, sends the message once more with DUP set.
+// loop() keeps the connection alive with PINGREQs. Only what reports need
+// is implemented: no subscriptions, will or QoS 2.
+class MqttClient
+{
+  public:
+    static const uint16_t KEEP_ALIVE = 60;      // Seconds, as told to the broker
+    static const uint16_t ACK_TIMEOUT = 5000;   // Wait for a CONNACK, PUBACK or PINGRESP (ms)
+    static const uint8_t MAX_RETRANSMIT = 1;
+
+    // Errors, besides the CONNACK return codes 1 to 5
+    static const int ERROR_CONNECTION = -1;     // Not connected, or the connection failed
+    static const int ERROR_TIMEOUT = -2;
+    static const int ERROR_PROTOCOL = -3;
+
+    void begin(Client& client);
+    int connect(const char* host, uint16_t port, const char* clientId,
+                const char* username, const char* password);
+    bool connected();
+    int publish(const char* topic, MeasurementPayload& payload);
+    void loop();
+    void disconnect();
+    uint8_t retransmissions();
+
+  private:
+    enum TYPE {
+      TYPE_CONNECT = 1, TYPE_CONNACK = 2, TYPE_PUBLISH = 3, TYPE_PUBACK = 4,
+      TYPE_PINGREQ = 12, TYPE_PINGRESP = 13, TYPE_DISCONNECT = 14
+    };
+
+    Client* _client = nullptr;
+    bool _connected = false;
+    uint16_t _packetId = 0;
+    uint32_t _lastSent = 0;
+    uint32_t _pingSent = 0;
+    bool _pingOutstanding = false;
+    uint8_t _retransmissions = 0;
+
+    bool writeHeader(uint8_t type, uint8_t flags, uint32_t length);
+    bool writeString(const char* text);
+    bool write(const uint8_t* bytes, size_t length);
+    bool writePublish(const char* topic, MeasurementPayload& payload, uint16_t packetId, bool duplicate);
+    int await(uint8_t type, uint16_t packetId);
+    int readPacket(uint8_t& type, uint8_t* body, uint8_t size);
+    int readByte();
+    void drop();
+};
+
+#endif
@@ -3,47 +3,65 @@
 
 /* From https://github.com/SwapBap/PMS */
 
-PMS::PMS(Stream& stream, bool fake = false)
+// Command frames are built at compile time, checksum included, and kept in
+// flash. Indexed by PMS::COMMAND.
+struct COMMAND_FRAME
+{
+  uint8_t bytes[7];
+};
+
+static constexpr COMMAND_FRAME commandFrame(uint8_t command, uint8_t dataH, uint8_t dataL)
+{
+  return {{ 0x42, 0x4D, command, dataH, dataL,
+            (uint8_t)((0x42 + 0x4D + command + dataH + dataL) >> 8),
+            (uint8_t)((0x42 + 0x4D + command + dataH + dataL) & 0xFF) }};
+}
+
+static_assert(commandFrame(0xE4, 0x00, 0x00).bytes[6] == 0x73, "Bad command checksum");
+
+static const COMMAND_FRAME COMMANDS[] PROGMEM = {
+  commandFrame(0xE4, 0x00, 0x00),   // Sleep
+  commandFrame(0xE4, 0x00, 0x01),   // Wake up
+  commandFrame(0xE1, 0x00, 0x01),   // Active mode
+  commandFrame(0xE1, 0x00, 0x00),   // Passive mode
+  commandFrame(0xE2, 0x00, 0x00),   // Read in passive mode
+};
+
+PMS::PMS(Stream& stream)
 {
   this->_stream = &stream;
-  this->_fake = fake;
+}
+
+// Kept for code written against the old fake data switch. The driver no
+// longer makes data up, `fake` is ignored; put a PMSFake in front of it
+// instead.
+PMS::PMS(Stream& stream, bool /* fake */) : PMS(stream)
+{
 }
 
 // Standby mode. For low power consumption and prolong the life of the sensor.
 void PMS::sleep()
 {
-  uint8_t command[] = { 0x42, 0x4D, 0xE4, 0x00, 0x00, 0x01, 0x73 };
-  if (!_fake) {
-    _stream->write(command, sizeof(command));
-  }
+  queue(COMMAND_SLEEP);
 }
 
 // Operating mode. Stable data should be got at least 30 seconds after the sensor wakeup from the sleep mode because of the fan's performance.
 void PMS::wakeUp()
 {
-  uint8_t command[] = { 0x42, 0x4D, 0xE4, 0x00, 0x01, 0x01, 0x74 };
-  if (!_fake) {
-    _stream->write(command, sizeof(command));
-  }
+  queue(COMMAND_WAKEUP);
 }
 
 // Active mode. Default mode after power up. In this mode sensor would send serial data to the host automatically.
 void PMS::activeMode()
 {
-  uint8_t command[] = { 0x42, 0x4D, 0xE1, 0x00, 0x01, 0x01, 0x71 };
-  if (!_fake) {
-    _stream->write(command, sizeof(command));
-  }
+  queue(COMMAND_ACTIVE);
   _mode = MODE_ACTIVE;
 }
 
 // Passive mode. In this mode sensor would send serial data to the host only for request.
 void PMS::passiveMode()
 {
-  uint8_t command[] = { 0x42, 0x4D, 0xE1, 0x00, 0x00, 0x01, 0x70 };
-  if (!_fake) {
-    _stream->write(command, sizeof(command));
-  }
+  queue(COMMAND_PASSIVE);
   _mode = MODE_PASSIVE;
 }
 
@@ -52,18 +70,72 @@ void PMS::requestRead()
 {
   if (_mode == MODE_PASSIVE)
   {
-    uint8_t command[] = { 0x42, 0x4D, 0xE2, 0x00, 0x00, 0x01, 0x71 };
-    if (!_fake) {
-      _stream->write(command, sizeof(command));
+    queue(COMMAND_READ);
+  }
+}
+
+// Non-blocking transmission of queued commands. Sends only what the stream can
+// take without blocking (one byte at a time if it can't tell) and keeps
+// COMMAND_INTERVAL between commands. Call it from the main loop.
+void PMS::handle()
+{
+  while (_txLen > 0)
+  {
+    if (_txPos == 0 && millis() - _txLast < COMMAND_INTERVAL)
+    {
+      return;
+    }
+
+    COMMAND_FRAME frame;
+    memcpy_P(&frame, &COMMANDS[_txQueue[_txHead]], sizeof(frame));
+
+    int room = _stream->availableForWrite();
+    size_t length = min((size_t)max(room, 1), sizeof(frame.bytes) - _txPos);
+    _txPos += _stream->write(frame.bytes + _txPos, length);
+    if (_txPos < sizeof(frame.bytes))
+    {
+      return;
     }
+
+    _txPos = 0;
+    _txHead = (_txHead + 1) % sizeof(_txQueue);
+    _txLen--;
+    _txLast = millis();
+  }
+}
+
+// Blocking transmission of all queued commands.
+void PMS::flush()
+{
+  while (_txLen > 0)
+  {
+    handle();
+    yield();
+  }
+}
+
+void PMS::queue(COMMAND command)
+{
+  // Queue full: make room the slow way rather than dropping a command
+  while (_txLen == sizeof(_txQueue))
+  {
+    handle();
+    yield();
   }
+
+  _txQueue[(_txHead + _txLen) % sizeof(_txQueue)] = command;
+  _txLen++;
+  handle();
 }
 
 // Non-blocking function for parse response.
 bool PMS::read(DATA& data)
 {
-  _data = &data;
   loop();
+  if (_status == STATUS_OK)
+  {
+    data = _frame;
+  }
 
   return _status == STATUS_OK;
 }
@@ -71,196 +143,285 @@ bool PMS::read(DATA& data)
 // Blocking function for parse response. Default timeout is 1s.
 bool PMS::readUntil(DATA& data, uint16_t timeout)
 {
-  _data = &data;
-  create_fake_data();
   uint32_t start = millis();
   do
   {
-    loop();
-    if (_status == STATUS_OK) break;
+    if (read(data)) break;
   } while (millis() - start < timeout);
 
+  if (_status != STATUS_OK)
+  {
+    _stats.timeouts++;
+  }
+
   return _status == STATUS_OK;
 }
 
-void PMS::loop()
+// Frame assembly driven by the receive path. Meant to be called from the
+// serial port's receive callback (EspSoftwareSerial's onReceive handler runs
+// from the scheduler, not from the RX interrupt), it parses everything that
+// has arrived so the newest complete frame is always available via latest().
+void PMS::receive()
 {
-  _status = STATUS_WAITING;
-  if (_fake || _stream->available())
+  do
   {
-    uint8_t ch;
-    if (! _fake)
+    loop();
+  } while (_status == STATUS_OK);
+}
+
+// O(1) pick-up of the newest complete, checksummed frame and the millis()
+// timestamp at which it arrived. Returns false until a frame was received.
+bool PMS::latest(DATA& data, uint32_t& timestamp)
+{
+  if (_frameCount == 0)
+  {
+    return false;
+  }
+
+  data = _frame;
+  timestamp = _frameMillis;
+  return true;
+}
+
+// Non-blocking request of a frame. In passive mode the request is sent to the
+// sensor and re-sent up to `retries` times if no frame arrives within
+// `timeout`; in active mode the next frame the sensor pushes is taken.
+// Completion is polled with pollRead().
+void PMS::beginRead(uint16_t timeout, uint8_t retries)
+{
+  requestRead();
+
+  _readStatus = READ_PENDING;
+  _readFrame = _frameCount;
+  _readStart = millis();
+  _readTimeout = timeout;
+  _readRetries = retries;
+}
+
+// Non-blocking completion of a read started by beginRead(). Returns READ_OK
+// or READ_TIMEOUT once, then READ_IDLE until the next beginRead().
+PMS::READ_STATUS PMS::pollRead(DATA& data)
+{
+  uint32_t timestamp;
+  return pollRead(data, timestamp);
+}
+
+// As above, also returning the millis() timestamp at which the frame arrived.
+PMS::READ_STATUS PMS::pollRead(DATA& data, uint32_t& timestamp)
+{
+  if (_readStatus != READ_PENDING)
+  {
+    return READ_IDLE;
+  }
+
+  // Frames may also have been assembled by receive() since the request
+  receive();
+  if (_frameCount != _readFrame)
+  {
+    data = _frame;
+    timestamp = _frameMillis;
+    _readStatus = READ_IDLE;
+    return READ_OK;
+  }
+
+  // The deadline runs from when the request has actually been sent, not
+  // from when it was queued behind other commands
+  if (_txLen > 0)
+  {
+    _readStart = millis();
+  }
+  else if (millis() - _readStart >= _readTimeout)
+  {
+    if (_readRetries == 0)
     {
-      ch = _stream->read();
+      _stats.timeouts++;
+      _readStatus = READ_IDLE;
+      return READ_TIMEOUT;
     }
-    else
+
+    _readRetries--;
+    requestRead();
+    _readStart = millis();
+  }
+
+  return READ_PENDING;
+}
+
+// Drain everything the stream has buffered in one block and run the frame
+// parser over it until a frame completes. Bytes left over after a complete
+// frame stay in _rxBuffer for the next call.
+void PMS::loop()
+{
+  _status = STATUS_WAITING;
+  handle();
+
+  while (_status != STATUS_OK)
+  {
+    if (_rxPos == _rxLen)
     {
-      ch = _fake_data[_index];
+      int available = _stream->available();
+      if (available <= 0)
+      {
+        return;
+      }
+
+      size_t length = min((size_t)available, sizeof(_rxBuffer));
+      _rxLen = _stream->readBytes(_rxBuffer, length);
+      _rxPos = 0;
+      if (_rxLen == 0)
+      {
+        return;
+      }
     }
 
-    switch (_index)
-    {
-      case 0:
-        if (ch != 0x42)
-        {
-          return;
-        }
-        _calculatedChecksum = ch;
-        break;
+    size_t consumed;
+    feed(_rxBuffer + _rxPos, _rxLen - _rxPos, consumed);
+    _rxPos += consumed;
+  }
+}
 
-      case 1:
-        if (ch != 0x4D)
-        {
-          _index = 0;
-          return;
-        }
-        _calculatedChecksum += ch;
-        break;
+// Parse raw bytes handed over directly by the caller, e.g. a block read from a
+// concrete serial type or an in-memory buffer, so no virtual Stream call is
+// made per byte. Stops after the first complete frame, which is then available
+// through latest(); `consumed` tells how much of the buffer was used.
+bool PMS::feed(const uint8_t* buffer, size_t length, size_t& consumed)
+{
+  uint32_t start = micros();
 
-      case 2:
-        _calculatedChecksum += ch;
-        _frameLen = ch << 8;
-        break;
+  _status = STATUS_WAITING;
+  consumed = 0;
+  while (consumed < length && _status != STATUS_OK)
+  {
+    parse(buffer[consumed++]);
+  }
 
-      case 3:
-        _frameLen |= ch;
-        // Unsupported sensor, different frame length, transmission error e.t.c.
-        if (_frameLen != 2 * 9 + 2 && _frameLen != 2 * 13 + 2)
-        {
-          _index = 0;
-          return;
-        }
-        _calculatedChecksum += ch;
-        break;
+  _stats.parseMicros += micros() - start;
+  return _status == STATUS_OK;
+}
+
+// Have `callback` called with the raw bytes of every frame of a supported
+// length, whether its checksum is valid or not.
+void PMS::onFrame(FRAME_CALLBACK callback)
+{
+  _frameCallback = callback;
+}
+
+// Parser health counters since start up or the last resetStats().
+PMS::STATS PMS::stats()
+{
+  return _stats;
+}
+
+void PMS::resetStats()
+{
+  _stats = {};
+}
 
-      default:
-        if (_index == _frameLen + 2)
+void PMS::parse(uint8_t ch)
+{
+  _stats.bytesRead++;
+
+  // Whole frame is kept for onFrame(), payload is common to all sensors (first 2x12 bytes)
+  if (_index < sizeof(_raw))
+  {
+    _raw[_index] = ch;
+  }
+
+  switch (_index)
+  {
+    case 0:
+      if (ch != 0x42)
+      {
+        _stats.resyncs++;
+        return;
+      }
+      _calculatedChecksum = ch;
+      _frameStart = micros();
+      break;
+
+    case 1:
+      if (ch != 0x4D)
+      {
+        _stats.resyncs++;
+        _index = 0;
+        return;
+      }
+      _calculatedChecksum += ch;
+      break;
+
+    case 2:
+      _calculatedChecksum += ch;
+      _frameLen = ch << 8;
+      break;
+
+    case 3:
+      _frameLen |= ch;
+      // Unsupported sensor, different frame length, transmission error e.t.c.
+      if (_frameLen != 2 * 9 + 2 && _frameLen != 2 * 13 + 2)
+      {
+        _stats.lengthErrors++;
+        _index = 0;
+        return;
+      }
+      _calculatedChecksum += ch;
+      break;
+
+    default:
+      if (_index == _frameLen + 2)
+      {
+        _checksum = ch << 8;
+      }
+      else if (_index == _frameLen + 2 + 1)
+      {
+        _checksum |= ch;
+        if (_frameCallback)
         {
-          _checksum = ch << 8;
+          _frameCallback(_raw, _frameLen + 4, _calculatedChecksum == _checksum);
         }
-        else if (_index == _frameLen + 2 + 1)
+
+        if (_calculatedChecksum == _checksum)
         {
-          _checksum |= ch;
-          if (_calculatedChecksum == _checksum)
-          {
-            _status = STATUS_OK;
-
-            // Standard Particles, CF=1.
-            _data->PM_SP_UG_1_0 = makeWord(_payload[0], _payload[1]);
-            _data->PM_SP_UG_2_5 = makeWord(_payload[2], _payload[3]);
-            _data->PM_SP_UG_10_0 = makeWord(_payload[4], _payload[5]);
-
-            // Atmospheric Environment.
-            _data->PM_AE_UG_1_0 = makeWord(_payload[6], _payload[7]);
-            _data->PM_AE_UG_2_5 = makeWord(_payload[8], _payload[9]);
-            _data->PM_AE_UG_10_0 = makeWord(_payload[10], _payload[11]);
-
-            // Total particles
-            _data->PM_TOTALPARTICLES_0_3 = makeWord(_payload[12], _payload[13]);
-            _data->PM_TOTALPARTICLES_0_5 = makeWord(_payload[14], _payload[15]);
-            _data->PM_TOTALPARTICLES_1_0 = makeWord(_payload[16], _payload[17]);
-            _data->PM_TOTALPARTICLES_2_5 = makeWord(_payload[18], _payload[19]);
-            _data->PM_TOTALPARTICLES_5_0 = makeWord(_payload[20], _payload[21]);
-            _data->PM_TOTALPARTICLES_10_0 = makeWord(_payload[22], _payload[23]);
-          }
-
-          _index = 0;
-          return;
+          const uint8_t* payload = _raw + 4;
+
+          _status = STATUS_OK;
+          _frameMillis = millis();
+          _frameCount++;
+          _stats.framesAccepted++;
+          _stats.frameMicros = micros() - _frameStart;
+
+          // Standard Particles, CF=1.
+          _frame.PM_SP_UG_1_0 = makeWord(payload[0], payload[1]);
+          _frame.PM_SP_UG_2_5 = makeWord(payload[2], payload[3]);
+          _frame.PM_SP_UG_10_0 = makeWord(payload[4], payload[5]);
+
+          // Atmospheric Environment.
+          _frame.PM_AE_UG_1_0 = makeWord(payload[6], payload[7]);
+          _frame.PM_AE_UG_2_5 = makeWord(payload[8], payload[9]);
+          _frame.PM_AE_UG_10_0 = makeWord(payload[10], payload[11]);
+
+          // Total particles
+          _frame.PM_TOTALPARTICLES_0_3 = makeWord(payload[12], payload[13]);
+          _frame.PM_TOTALPARTICLES_0_5 = makeWord(payload[14], payload[15]);
+          _frame.PM_TOTALPARTICLES_1_0 = makeWord(payload[16], payload[17]);
+          _frame.PM_TOTALPARTICLES_2_5 = makeWord(payload[18], payload[19]);
+          _frame.PM_TOTALPARTICLES_5_0 = makeWord(payload[20], payload[21]);
+          _frame.PM_TOTALPARTICLES_10_0 = makeWord(payload[22], payload[23]);
         }
         else
         {
-          _calculatedChecksum += ch;
-          uint8_t payloadIndex = _index - 4;
-
-          // Payload is common to all sensors (first 2x6 bytes).
-          if (payloadIndex < sizeof(_payload))
-          {
-            _payload[payloadIndex] = ch;
-          }
+          _stats.checksumErrors++;
         }
 
-        break;
-    }
+        _index = 0;
+        return;
+      }
+      else
+      {
+        _calculatedChecksum += ch;
+      }
 
-    _index++;
+      break;
   }
-}
 
-void PMS::create_fake_data()
-{
-  uint16_t calculatedChecksum = 0x00;
-
-  randomSeed(analogRead(0));
-  uint16_t pms_1_0 = random(0, 500);
-  uint16_t pms_2_5 = random(0, 500);
-  uint16_t pms_10 = random(0, 500);
-  
-  for (uint8_t index = 0; index < 32; index++)
-  {
-    switch (index)
-    {
-      case 0:
-        _fake_data[index] = 0x42;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 1:
-        _fake_data[index] = 0x4D;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 2:
-        _fake_data[index] = 0x00;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 3:
-        _fake_data[index] = 28;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 10:
-        _fake_data[index] = (pms_1_0 >> 8) & 0xFF;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 11:
-        _fake_data[index] = pms_1_0 & 0xFF;
-        calculatedChecksum += _fake_data[index];
-        break;
-        
-      case 12:
-        _fake_data[index] = (pms_2_5 >> 8) & 0xFF;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 13:
-        _fake_data[index] = pms_2_5 & 0xFF;
-        calculatedChecksum += _fake_data[index];
-        break;
-      
-      case 14:
-        _fake_data[index] = (pms_10 >> 8) & 0xFF;
-        calculatedChecksum += _fake_data[index];
-        break;
-
-      case 15:
-        _fake_data[index] = pms_10 & 0xFF;
-        calculatedChecksum += _fake_data[index];
-        break;
-      
-      case 30:
-        _fake_data[index] = (calculatedChecksum >> 8) & 0xFF;
-        break;
-
-      case 31:
-        _fake_data[index] = calculatedChecksum & 0xFF;
-        break;
-
-      default:
-        _fake_data[index] = 0;
-        calculatedChecksum += _fake_data[index];
-        break;
-    }
-  }
+  _index++;
 }
@@ -3,6 +3,14 @@
 
 /* From https://github.com/SwapBap/PMS */
 
+/*
+  Besides Stream, the driver only needs millis(), micros(), yield(), min(),
+  max(), makeWord() and PROGMEM/memcpy_P() from the platform, so it can be
+  built off target against stand-ins for those, as test/ does. feed() lets
+  such a build push bytes straight into the parser without a Stream, and
+  PMSFake simulates a sensor behind a Stream.
+*/
+
 #include "Stream.h"
 
 class PMS
@@ -14,6 +22,13 @@ class PMS
 
     static const uint16_t BAUD_RATE = 9600;
 
+    static const uint8_t READ_RETRIES = 2;
+    static const uint16_t COMMAND_INTERVAL = 100;
+
+    enum READ_STATUS { READ_IDLE, READ_PENDING, READ_OK, READ_TIMEOUT };
+
+    typedef void (*FRAME_CALLBACK)(const uint8_t* frame, uint8_t length, bool valid);
+
     struct DATA {
       // Standard Particles, CF=1
       uint16_t PM_SP_UG_1_0;
@@ -34,6 +49,19 @@ class PMS
       uint16_t PM_TOTALPARTICLES_10_0;
     };
 
+    // Parser health counters, see stats() and resetStats()
+    struct STATS {
+      uint32_t bytesRead;           // Bytes run through the parser
+      uint32_t framesAccepted;      // Frames with a valid checksum
+      uint32_t checksumErrors;      // Frames dropped for a bad checksum
+      uint32_t resyncs;             // Bytes dropped while looking for a frame start
+      uint32_t lengthErrors;        // Frames dropped for an unsupported length
+      uint32_t timeouts;            // readUntil() and pollRead() giving up
+      uint32_t parseMicros;         // Time spent parsing
+      uint32_t frameMicros;         // First to last byte of the last accepted frame
+    };
+
+    PMS(Stream&);
     PMS(Stream&, bool);
     void sleep();
     void wakeUp();
@@ -41,16 +69,32 @@ class PMS
     void passiveMode();
 
     void requestRead();
+    void handle();
+    void flush();
+
     bool read(DATA& data);
     bool readUntil(DATA& data, uint16_t timeout = SINGLE_RESPONSE_TIME);
 
+    void beginRead(uint16_t timeout = SINGLE_RESPONSE_TIME, uint8_t retries = READ_RETRIES);
+    READ_STATUS pollRead(DATA& data);
+    READ_STATUS pollRead(DATA& data, uint32_t& timestamp);
+
+    void receive();
+    bool latest(DATA& data, uint32_t& timestamp);
+    bool feed(const uint8_t* buffer, size_t length, size_t& consumed);
+    void onFrame(FRAME_CALLBACK callback);
+
+    STATS stats();
+    void resetStats();
+
   private:
     enum STATUS { STATUS_WAITING, STATUS_OK };
     enum MODE { MODE_ACTIVE, MODE_PASSIVE };
+    enum COMMAND { COMMAND_SLEEP, COMMAND_WAKEUP, COMMAND_ACTIVE, COMMAND_PASSIVE, COMMAND_READ };
 
-    uint8_t _payload[24];
+    uint8_t _raw[32];
+    FRAME_CALLBACK _frameCallback = nullptr;
     Stream* _stream;
-    DATA* _data;
     STATUS _status;
     MODE _mode = MODE_ACTIVE;
 
@@ -58,12 +102,38 @@ class PMS
     uint16_t _frameLen;
     uint16_t _checksum;
     uint16_t _calculatedChecksum;
+    uint32_t _frameStart;
 
-    void loop();
+    STATS _stats = {};
+
+    // Newest complete frame and the millis() timestamp it arrived at
+    DATA _frame;
+    uint32_t _frameMillis = 0;
+    uint32_t _frameCount = 0;
+
+    // Bytes drained from the stream in one block, parsed from _rxPos onwards
+    uint8_t _rxBuffer[32];
+    uint8_t _rxLen = 0;
+    uint8_t _rxPos = 0;
 
-    bool _fake;
-    uint8_t _fake_data[32];
-    void create_fake_data();
+    // Commands waiting to be sent, _txPos bytes of the first one already out
+    uint8_t _txQueue[8];
+    uint8_t _txHead = 0;
+    uint8_t _txLen = 0;
+    uint8_t _txPos = 0;
+    uint32_t _txLast = 0;
+
+    void queue(COMMAND command);
+
+    // Pending asynchronous read started by beginRead()
+    READ_STATUS _readStatus = READ_IDLE;
+    uint32_t _readFrame;
+    uint32_t _readStart;
+    uint16_t _readTimeout;
+    uint8_t _readRetries;
+
+    void loop();
+    void parse(uint8_t ch);
 };
 
 #endif
@@ -0,0 +1,92 @@
+#include "Arduino.h"
+#include "PMSAggregate.h"
+
+// Every field of PMS::DATA, so they can all be summarized by the same code
+static uint16_t PMS::DATA::* const FIELDS[] = {
+  &PMS::DATA::PM_SP_UG_1_0,
+  &PMS::DATA::PM_SP_UG_2_5,
+  &PMS::DATA::PM_SP_UG_10_0,
+  &PMS::DATA::PM_AE_UG_1_0,
+  &PMS::DATA::PM_AE_UG_2_5,
+  &PMS::DATA::PM_AE_UG_10_0,
+  &PMS::DATA::PM_TOTALPARTICLES_0_3,
+  &PMS::DATA::PM_TOTALPARTICLES_0_5,
+  &PMS::DATA::PM_TOTALPARTICLES_1_0,
+  &PMS::DATA::PM_TOTALPARTICLES_2_5,
+  &PMS::DATA::PM_TOTALPARTICLES_5_0,
+  &PMS::DATA::PM_TOTALPARTICLES_10_0,
+};
+
+// Start a new window.
+void PMSAggregate::reset()
+{
+  _count = 0;
+}
+
+// Add a frame to the window. Returns false once MAX_SAMPLES frames are held.
+bool PMSAggregate::add(const PMS::DATA& data)
+{
+  if (_count >= MAX_SAMPLES)
+  {
+    return false;
+  }
+
+  _samples[_count++] = data;
+  return true;
+}
+
+uint8_t PMSAggregate::count() const
+{
+  return _count;
+}
+
+// Min, max, median and interquartile mean of every field, rounded to the
+// nearest integer. Returns false if the window is empty.
+bool PMSAggregate::summarize(RESULT& result) const
+{
+  if (_count == 0)
+  {
+    return false;
+  }
+
+  uint8_t trim = _count / 4;
+  uint8_t kept = _count - 2 * trim;
+
+  for (uint8_t field = 0; field < sizeof(FIELDS) / sizeof(FIELDS[0]); field++)
+  {
+    uint16_t PMS::DATA::* member = FIELDS[field];
+
+    // Insertion sort, the window is small
+    uint16_t values[MAX_SAMPLES];
+    for (uint8_t i = 0; i < _count; i++)
+    {
+      uint16_t value = _samples[i].*member;
+      uint8_t j = i;
+      for (; j > 0 && values[j - 1] > value; j--)
+      {
+        values[j] = values[j - 1];
+      }
+      values[j] = value;
+    }
+
+    uint32_t sum = 0;
+    for (uint8_t i = trim; i < _count - trim; i++)
+    {
+      sum += values[i];
+    }
+
+    result.min.*member = values[0];
+    result.max.*member = values[_count - 1];
+    if (_count % 2)
+    {
+      result.median.*member = values[_count / 2];
+    }
+    else
+    {
+      result.median.*member = ((uint32_t)values[_count / 2 - 1] + values[_count / 2] + 1) / 2;
+    }
+    result.mean.*member = (sum + kept / 2) / kept;
+  }
+
+  return true;
+}
@@ -0,0 +1,30 @@
+#ifndef PMS_AGGREGATE_H
+#define PMS_AGGREGATE_H
+
+#include "PMS.h"
+
+// Collects the PMS frames of one wake window and summarizes every field of
+// PMS::DATA. Fixed-size storage and integer math only, no heap.
+class PMSAggregate
+{
+  public:
+    static const uint8_t MAX_SAMPLES = 16;
+
+    struct RESULT {
+      PMS::DATA min;
+      PMS::DATA max;
+      PMS::DATA median;
+      PMS::DATA mean;     // Interquartile mean, a quarter trimmed from each end
+    };
+
+    void reset();
+    bool add(const PMS::DATA& data);
+    uint8_t count() const;
+    bool summarize(RESULT& result) const;
+
+  private:
+    PMS::DATA _samples[MAX_SAMPLES];
+    uint8_t _count = 0;
+};
+
+#endif
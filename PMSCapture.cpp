@@ -0,0 +1,154 @@
+#include "Arduino.h"
+#include "PMSCapture.h"
+#include <time.h>
+
+PMSCapture::PMSCapture(FS& fs, const char* path, uint32_t maxSize)
+{
+  _fs = &fs;
+  strncpy(_path, path, sizeof(_path) - 1);
+  _path[sizeof(_path) - 1] = '\0';
+  snprintf(_oldPath, sizeof(_oldPath), "%s.1", _path);
+  _maxSize = maxSize;
+  _size = 0;
+}
+
+// Continue the file left by a previous boot, so writes line up with its
+// pages. Call once the file system is mounted.
+void PMSCapture::begin()
+{
+  File file = _fs->open(_path, "r+");
+  _size = file ? file.size() : 0;
+
+  // A file that doesn't start with a record was cut somewhere else (or
+  // written by an older version); keep it for replay() but don't add to it
+  RECORD first;
+  if (_size >= sizeof(first)
+      && (file.read((uint8_t*)&first, sizeof(first)) != sizeof(first) || first.marker != MARKER))
+  {
+    file.close();
+    rotate();
+    return;
+  }
+
+  // Without a flush() before the reset, the file ends in the part of a record
+  // that filled the last page. Cut it off so appends start on a record.
+  if (_size % sizeof(RECORD) != 0)
+  {
+    _size -= _size % sizeof(RECORD);
+    file.truncate(_size);
+  }
+  file.close();
+}
+
+// Buffer one frame as passed to a PMS::FRAME_CALLBACK. Meant to be called
+// from that callback; flash is only written once a page is full.
+void PMSCapture::append(const uint8_t* frame, uint8_t length, bool valid)
+{
+  RECORD record = {};
+  time_t now = time(nullptr);
+  record.time = now > 0 ? now : 0;
+  record.millis = millis();
+  record.valid = valid;
+  record.length = min(length, (uint8_t)sizeof(record.frame));
+  record.marker = MARKER;
+  memcpy(record.frame, frame, record.length);
+
+  // Rotate between records, never in the middle of one
+  if (_size + _page.length() > 0 && _size + _page.length() + sizeof(record) > _maxSize)
+  {
+    flush();
+    rotate();
+  }
+
+  // Records straddle pages, so one may take two writes
+  const uint8_t* bytes = (const uint8_t*)&record;
+  uint16_t left = sizeof(record);
+  while (left > 0)
+  {
+    uint16_t taken = _page.append(bytes, left, _size);
+    bytes += taken;
+    left -= taken;
+
+    if (_page.full(_size))
+    {
+      write();
+    }
+  }
+}
+
+// Write out the frames buffered so far, so the file can be copied off or
+// replayed as it is.
+void PMSCapture::flush()
+{
+  if (_page.length() > 0)
+  {
+    write();
+  }
+}
+
+// Bytes lost because the file couldn't be written.
+uint32_t PMSCapture::dropped()
+{
+  return _dropped;
+}
+
+void PMSCapture::write()
+{
+  uint16_t length = _page.length();
+  size_t written = _page.writeTo(*_fs, _path);
+
+  _size += written;
+  _dropped += length - written;
+}
+
+void PMSCapture::rotate()
+{
+  _fs->remove(_oldPath);
+  _fs->rename(_path, _oldPath);
+  _size = 0;
+}
+
+// Read the next record of a capture file. Bytes that don't start a record,
+// e.g. what is left of one after a failed write, are skipped. Returns false
+// at the end of the file.
+bool PMSCapture::readRecord(Stream& capture, RECORD& record)
+{
+  uint8_t* bytes = (uint8_t*)&record;
+  if (capture.readBytes(bytes, sizeof(record)) != sizeof(record))
+  {
+    return false;
+  }
+
+  while (record.marker != MARKER || record.valid > 1 || record.length > sizeof(record.frame))
+  {
+    memmove(bytes, bytes + 1, sizeof(record) - 1);
+    if (capture.readBytes(bytes + sizeof(record) - 1, 1) != 1)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Run the frames of a capture file through `pms` and count the records for
+// which the parser now decides differently than when they were captured.
+// Returns the number of records replayed.
+uint32_t PMSCapture::replay(Stream& capture, PMS& pms, uint32_t& mismatches)
+{
+  RECORD record;
+  uint32_t records = 0;
+
+  mismatches = 0;
+  while (readRecord(capture, record))
+  {
+    size_t consumed;
+    bool valid = pms.feed(record.frame, record.length, consumed);
+    if (valid != (bool)record.valid)
+    {
+      mismatches++;
+    }
+    records++;
+  }
+
+  return records;
+}
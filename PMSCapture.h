@@ -0,0 +1,52 @@
+#ifndef PMS_CAPTURE_H
+#define PMS_CAPTURE_H
+
+#include <FS.h>
+#include "PMS.h"
+#include "PageBuffer.h"
+
+// Appends the raw frames seen by PMS to a file, for replaying them through
+// the parser later. Records are buffered and written in whole flash pages;
+// before a record that would take the file past its maximum size it is
+// rotated to `<path>.1`, so at most twice that size is used and both files
+// hold whole records only.
+class PMSCapture
+{
+  public:
+    static const uint16_t MARKER = 0xCA97;
+
+    struct RECORD {
+      uint32_t time;        // Epoch seconds, 0 if not known yet
+      uint32_t millis;
+      uint8_t valid;        // Checksum matched
+      uint8_t length;
+      uint8_t frame[32];
+      uint16_t marker;      // MARKER, to find records again after a partial write
+    };
+
+    PMSCapture(FS& fs, const char* path, uint32_t maxSize);
+    void begin();
+    void append(const uint8_t* frame, uint8_t length, bool valid);
+    void flush();
+    uint32_t dropped();
+
+    static bool readRecord(Stream& capture, RECORD& record);
+
+    // Used off target, see test/test_capture.cpp
+    static uint32_t replay(Stream& capture, PMS& pms, uint32_t& mismatches);
+
+  private:
+    FS* _fs;
+    char _path[24];
+    char _oldPath[26];
+    uint32_t _maxSize;
+    uint32_t _size;
+    uint32_t _dropped = 0;
+
+    PageBuffer _page;
+
+    void write();
+    void rotate();
+};
+
+#endif
@@ -0,0 +1,354 @@
+#include "Arduino.h"
+#include "PMSFake.h"
+#include "PMSCapture.h"
+
+// Scenario used until loadScenario() succeeds: clean air, slightly noisy
+static const PMSFake::STEP DEFAULT_STEP = { 0, 8, 12, 16, 3, PMSFake::EVENT_NONE };
+
+PMSFake::PMSFake(uint32_t seed)
+{
+  _seed = seed;
+  _steps[0] = DEFAULT_STEP;
+  _stepCount = 1;
+  _commandPos = 0;
+  _asleep = false;
+  _passive = false;
+  _requests = 0;
+  restart();
+}
+
+// Least time between two frames, in ms: the period of the frames sent in
+// active mode, and in passive mode how long a read request is held after the
+// previous frame before it is answered. 0 sends a new frame as soon as the
+// previous one was read, or answers requests right away.
+void PMSFake::setFrameInterval(uint16_t interval)
+{
+  _frameInterval = interval;
+}
+
+// Load a scenario, one step per line:
+//   frames,pm1_0,pm2_5,pm10_0,jitter[,spike|dropout|corrupt]
+// Empty lines and lines starting with # are skipped. The scenario loops once
+// its last step is done. On error the default scenario is used and false is
+// returned.
+bool PMSFake::loadScenario(Stream& csv)
+{
+  char line[64];
+  bool ok = true;
+
+  _stepCount = 0;
+  while (ok && csv.available())
+  {
+    uint8_t length = 0;
+    while (csv.available())
+    {
+      int ch = csv.read();
+      if (ch == '\n' || ch < 0)
+      {
+        break;
+      }
+      if (ch != '\r' && length < sizeof(line) - 1)
+      {
+        line[length++] = ch;
+      }
+    }
+    line[length] = '\0';
+
+    if (length == 0 || line[0] == '#')
+    {
+      continue;
+    }
+
+    if (_stepCount == MAX_STEPS)
+    {
+      ok = false;
+      break;
+    }
+
+    STEP& step = _steps[_stepCount];
+    uint16_t* values[] = { &step.frames, &step.pm1_0, &step.pm2_5, &step.pm10_0, &step.jitter };
+    char* cursor = line;
+    for (uint8_t i = 0; ok && i < sizeof(values) / sizeof(values[0]); i++)
+    {
+      char* end;
+      unsigned long value = strtoul(cursor, &end, 10);
+      ok = end != cursor && value <= 0xFFFF && (*end == ',' || *end == '\0');
+      *values[i] = value;
+      cursor = *end == ',' ? end + 1 : end;
+    }
+
+    while (*cursor == ' ')
+    {
+      cursor++;
+    }
+    if (*cursor == '\0')
+    {
+      step.event = EVENT_NONE;
+    }
+    else if (strcmp(cursor, "spike") == 0)
+    {
+      step.event = EVENT_SPIKE;
+    }
+    else if (strcmp(cursor, "dropout") == 0)
+    {
+      step.event = EVENT_DROPOUT;
+    }
+    else if (strcmp(cursor, "corrupt") == 0)
+    {
+      step.event = EVENT_CORRUPT;
+    }
+    else
+    {
+      ok = false;
+    }
+
+    _stepCount++;
+  }
+
+  if (!ok || _stepCount == 0)
+  {
+    _steps[0] = DEFAULT_STEP;
+    _stepCount = 1;
+  }
+
+  restart();
+  return ok;
+}
+
+// Send the frames of a PMSCapture file, valid or not, in place of the
+// scenario's, one per frame interval or read request. `capture` has to stay
+// open; the scenario takes over again once it has been played.
+void PMSFake::loadCapture(Stream& capture)
+{
+  _capture = &capture;
+}
+
+// Start the scenario over from its first step with the original seed. The
+// sleep and passive mode state set by commands is kept.
+void PMSFake::restart()
+{
+  _random = _seed ? _seed : 1;
+  _step = 0;
+  _stepFrame = 0;
+  _frameLen = 0;
+  _framePos = 0;
+  _frameLast = millis();
+}
+
+int PMSFake::available()
+{
+  if (_framePos == _frameLen && frameDue())
+  {
+    generate();
+  }
+
+  return _frameLen - _framePos;
+}
+
+int PMSFake::read()
+{
+  if (available() == 0)
+  {
+    return -1;
+  }
+
+  return _frame[_framePos++];
+}
+
+int PMSFake::peek()
+{
+  if (available() == 0)
+  {
+    return -1;
+  }
+
+  return _frame[_framePos];
+}
+
+// Commands from PMS, acted upon once a complete frame with a valid checksum
+// has been written.
+size_t PMSFake::write(uint8_t ch)
+{
+  if ((_commandPos == 0 && ch != 0x42) || (_commandPos == 1 && ch != 0x4D))
+  {
+    _commandPos = 0;
+    return 1;
+  }
+
+  _command[_commandPos++] = ch;
+  if (_commandPos == sizeof(_command))
+  {
+    _commandPos = 0;
+    command();
+  }
+
+  return 1;
+}
+
+void PMSFake::flush()
+{
+}
+
+// xorshift32, cheap and reproducible on every platform
+uint32_t PMSFake::random()
+{
+  _random ^= _random << 13;
+  _random ^= _random >> 17;
+  _random ^= _random << 5;
+  return _random;
+}
+
+uint16_t PMSFake::vary(uint16_t value, uint16_t jitter)
+{
+  if (jitter == 0)
+  {
+    return value;
+  }
+
+  int32_t varied = (int32_t)value + (int32_t)(random() % (2 * jitter + 1)) - jitter;
+  return constrain(varied, 0, 0xFFFF);
+}
+
+bool PMSFake::frameDue()
+{
+  if (_asleep)
+  {
+    return false;
+  }
+
+  if (_passive && _requests == 0)
+  {
+    return false;
+  }
+
+  return millis() - _frameLast >= _frameInterval;
+}
+
+// Build the next frame of the scenario into _frame.
+void PMSFake::generate()
+{
+  if (_passive)
+  {
+    _requests--;
+  }
+  _frameLast = millis();
+  _frameLen = 0;
+  _framePos = 0;
+
+  if (_capture != nullptr && replay())
+  {
+    return;
+  }
+
+  const STEP& step = _steps[_step];
+  if (step.frames != 0 && ++_stepFrame >= step.frames)
+  {
+    _stepFrame = 0;
+    _step = (_step + 1) % _stepCount;
+  }
+
+  // Sensor silent for this frame
+  if (step.event == EVENT_DROPOUT)
+  {
+    return;
+  }
+
+  uint32_t scale = step.event == EVENT_SPIKE ? 5 : 1;
+  uint32_t pm1_0 = vary(step.pm1_0, step.jitter) * scale;
+  uint32_t pm2_5 = max(vary(step.pm2_5, step.jitter) * scale, pm1_0);
+  uint32_t pm10_0 = max(vary(step.pm10_0, step.jitter) * scale, pm2_5);
+
+  // Atmospheric values read lower than CF=1 ones at high concentrations, and
+  // particle counts (per 0.1 L) grow towards the smaller sizes
+  uint32_t counts_10_0 = (pm10_0 - pm2_5) / 2;
+  uint32_t counts_5_0 = counts_10_0 + (pm10_0 - pm2_5);
+  uint32_t counts_2_5 = counts_5_0 + 2 * (pm2_5 - pm1_0);
+  uint32_t counts_1_0 = counts_2_5 + 8 * pm1_0;
+  uint32_t counts_0_5 = counts_1_0 + 30 * pm1_0;
+  uint32_t counts_0_3 = counts_0_5 + 100 * pm1_0;
+
+  uint32_t values[] = {
+    pm1_0, pm2_5, pm10_0,
+    pm1_0 <= 30 ? pm1_0 : 30 + (pm1_0 - 30) * 2 / 3,
+    pm2_5 <= 30 ? pm2_5 : 30 + (pm2_5 - 30) * 2 / 3,
+    pm10_0 <= 30 ? pm10_0 : 30 + (pm10_0 - 30) * 2 / 3,
+    counts_0_3, counts_0_5, counts_1_0, counts_2_5, counts_5_0, counts_10_0,
+    0,  // Version and error code
+  };
+
+  _frame[0] = 0x42;
+  _frame[1] = 0x4D;
+  _frame[2] = 0x00;
+  _frame[3] = 2 * 13 + 2;
+  for (uint8_t i = 0; i < 13; i++)
+  {
+    uint16_t value = min(values[i], (uint32_t)0xFFFF);
+    _frame[4 + 2 * i] = value >> 8;
+    _frame[5 + 2 * i] = value & 0xFF;
+  }
+
+  uint16_t checksum = 0;
+  for (uint8_t i = 0; i < 30; i++)
+  {
+    checksum += _frame[i];
+  }
+  _frame[30] = checksum >> 8;
+  _frame[31] = checksum & 0xFF;
+  _frameLen = 32;
+
+  // Flip one payload bit after the checksum was computed
+  if (step.event == EVENT_CORRUPT)
+  {
+    _frame[4 + random() % 26] ^= 1 << (random() % 8);
+  }
+}
+
+// Take the next frame from the capture, if there is one left.
+bool PMSFake::replay()
+{
+  PMSCapture::RECORD record;
+  if (!PMSCapture::readRecord(*_capture, record))
+  {
+    _capture = nullptr;
+    return false;
+  }
+
+  _frameLen = record.length;
+  memcpy(_frame, record.frame, _frameLen);
+  return true;
+}
+
+void PMSFake::command()
+{
+  uint16_t checksum = 0;
+  for (uint8_t i = 0; i < 5; i++)
+  {
+    checksum += _command[i];
+  }
+  if (checksum != ((_command[5] << 8) | _command[6]))
+  {
+    return;
+  }
+
+  switch (_command[2])
+  {
+    case 0xE1:
+      _passive = _command[4] == 0x00;
+      _requests = 0;
+      _frameLast = millis();
+      break;
+
+    case 0xE2:
+      if (_passive && _requests < 0xFF)
+      {
+        _requests++;
+      }
+      break;
+
+    case 0xE4:
+      _asleep = _command[4] == 0x00;
+      _requests = 0;
+      _frameLast = millis();
+      break;
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef PMS_FAKE_H
+#define PMS_FAKE_H
+
+#include "Stream.h"
+
+// Simulated Plantower sensor behind a Stream, to be handed to PMS instead of
+// a serial port. Frames carry all twelve PMS::DATA fields and follow a
+// scripted scenario; the same seed and scenario always produce the same bytes.
+// Understands the sleep/wake up, active/passive and read commands PMS sends.
+// A capture recorded by PMSCapture can be played back instead of the
+// scenario, frame for frame.
+class PMSFake : public Stream
+{
+  public:
+    static const uint8_t MAX_STEPS = 16;
+    static const uint16_t FRAME_INTERVAL = 1000;
+
+    enum EVENT { EVENT_NONE, EVENT_SPIKE, EVENT_DROPOUT, EVENT_CORRUPT };
+
+    // One scenario step: `frames` frames (0 = forever) around the given
+    // concentrations, each value varying randomly by up to +/- `jitter`
+    struct STEP {
+      uint16_t frames;
+      uint16_t pm1_0;
+      uint16_t pm2_5;
+      uint16_t pm10_0;
+      uint16_t jitter;
+      EVENT event;
+    };
+
+    PMSFake(uint32_t seed);
+    void setFrameInterval(uint16_t interval);
+    bool loadScenario(Stream& csv);
+    void loadCapture(Stream& capture);
+    void restart();
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t ch) override;
+    void flush() override;
+
+  private:
+    uint32_t _seed;
+    uint32_t _random;
+
+    Stream* _capture = nullptr;
+
+    STEP _steps[MAX_STEPS];
+    uint8_t _stepCount;
+    uint8_t _step;
+    uint16_t _stepFrame;
+
+    uint8_t _frame[32];
+    uint8_t _frameLen;
+    uint8_t _framePos;
+    uint32_t _frameLast;
+    uint16_t _frameInterval = FRAME_INTERVAL;
+
+    uint8_t _command[7];
+    uint8_t _commandPos;
+
+    bool _asleep;
+    bool _passive;
+    uint8_t _requests;
+
+    uint32_t random();
+    uint16_t vary(uint16_t value, uint16_t jitter);
+    bool frameDue();
+    void generate();
+    bool replay();
+    void command();
+};
+
+#endif
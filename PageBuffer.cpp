@@ -0,0 +1,53 @@
+#include "Arduino.h"
+#include "PageBuffer.h"
+
+// Take as much of `data` as fits before the next page boundary of a file
+// that is `fileSize` bytes long without what is buffered. Returns the number
+// of bytes taken.
+uint16_t PageBuffer::append(const void* data, uint16_t length, uint32_t fileSize)
+{
+  uint16_t room = PAGE_SIZE - (fileSize + _length) % PAGE_SIZE;
+  length = min(length, room);
+  memcpy(_buffer + _length, data, length);
+  _length += length;
+  return length;
+}
+
+// Whether the buffer reaches the page boundary and should be written.
+bool PageBuffer::full(uint32_t fileSize)
+{
+  return _length > 0 && (fileSize + _length) % PAGE_SIZE == 0;
+}
+
+// Bytes buffered.
+uint16_t PageBuffer::length()
+{
+  return _length;
+}
+
+// The buffered bytes, oldest first.
+const uint8_t* PageBuffer::data()
+{
+  return _buffer;
+}
+
+// Drop the first `length` buffered bytes, which will then never be written.
+// The rest still lands on the page boundaries of the file.
+void PageBuffer::discard(uint16_t length)
+{
+  length = min(length, _length);
+  memmove(_buffer, _buffer + length, _length - length);
+  _length -= length;
+}
+
+// Append the buffered bytes to `path` and empty the buffer. Returns the
+// number of bytes written; any others are lost.
+size_t PageBuffer::writeTo(FS& fs, const char* path)
+{
+  File file = fs.open(path, "a");
+  size_t written = file ? file.write(_buffer, _length) : 0;
+  file.close();
+
+  _length = 0;
+  return written;
+}
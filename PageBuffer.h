@@ -0,0 +1,27 @@
+#ifndef PAGE_BUFFER_H
+#define PAGE_BUFFER_H
+
+#include <FS.h>
+
+// Bytes on their way to the end of a file, collected in RAM and written out
+// a flash page at a time. append() stops at the next page boundary of the
+// file rather than after PAGE_SIZE bytes, so writes line up with pages again
+// after a partial write, e.g. one forced by a flush before deep sleep.
+class PageBuffer
+{
+  public:
+    static const uint16_t PAGE_SIZE = 256;
+
+    uint16_t append(const void* data, uint16_t length, uint32_t fileSize);
+    bool full(uint32_t fileSize);
+    uint16_t length();
+    const uint8_t* data();
+    void discard(uint16_t length);
+    size_t writeTo(FS& fs, const char* path);
+
+  private:
+    uint8_t _buffer[PAGE_SIZE];
+    uint16_t _length = 0;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "Arduino.h"
+#include "Timestamp.h"
+
+// "00" to "99", so numbers are written two digits at a time
+static const char DIGIT_PAIRS[] PROGMEM =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// UTC calendar fields of `epoch`. The result stays valid until the next call.
+const Timestamp::CALENDAR& Timestamp::breakdown(uint32_t epoch)
+{
+  uint32_t days = epoch / 86400;
+  uint32_t seconds = epoch % 86400;
+
+  if (days == _days + 1)
+  {
+    // Next day, as when going through readings in order
+    _days = days;
+    if (++_calendar.day > daysInMonth(_calendar.year, _calendar.month))
+    {
+      _calendar.day = 1;
+      if (++_calendar.month > 12)
+      {
+        _calendar.month = 1;
+        _calendar.year++;
+      }
+    }
+  }
+  else if (days != _days)
+  {
+    // Days to civil date, from Howard Hinnant's date algorithms, with March
+    // as the first month so leap days come last
+    _days = days;
+    uint32_t shifted = days + 719468;
+    uint32_t era = shifted / 146097;
+    uint32_t dayOfEra = shifted - era * 146097;
+    uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    uint32_t monthIndex = (5 * dayOfYear + 2) / 153;
+
+    _calendar.day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    _calendar.month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    _calendar.year = yearOfEra + era * 400 + (_calendar.month <= 2 ? 1 : 0);
+  }
+
+  _calendar.hour = seconds / 3600;
+  _calendar.minute = seconds / 60 % 60;
+  _calendar.second = seconds % 60;
+  return _calendar;
+}
+
+// Write `epoch` as ISO8601_LENGTH characters to `buffer`, not terminated.
+void Timestamp::formatIso8601(char* buffer, uint32_t epoch)
+{
+  const CALENDAR& calendar = breakdown(epoch);
+
+  formatNumber(buffer, 4, calendar.year);
+  buffer[4] = '-';
+  formatNumber(buffer + 5, 2, calendar.month);
+  buffer[7] = '-';
+  formatNumber(buffer + 8, 2, calendar.day);
+  buffer[10] = 'T';
+  formatNumber(buffer + 11, 2, calendar.hour);
+  buffer[13] = ':';
+  formatNumber(buffer + 14, 2, calendar.minute);
+  buffer[16] = ':';
+  formatNumber(buffer + 17, 2, calendar.second);
+  memcpy(buffer + 19, ".000Z", 5);
+}
+
+// Write `value` right aligned into exactly `width` characters, filling the
+// left with `pad`. Digits that don't fit are cut off at the left.
+void Timestamp::formatNumber(char* buffer, uint8_t width, uint32_t value, char pad)
+{
+  char* digit = buffer + width;
+
+  while (value >= 10 && digit - buffer >= 2)
+  {
+    digit -= 2;
+    memcpy_P(digit, DIGIT_PAIRS + 2 * (value % 100), 2);
+    value /= 100;
+  }
+
+  if (digit > buffer && (value > 0 || digit == buffer + width))
+  {
+    *--digit = '0' + value % 10;
+  }
+
+  while (digit > buffer)
+  {
+    *--digit = pad;
+  }
+}
+
+uint8_t Timestamp::daysInMonth(uint16_t year, uint8_t month)
+{
+  if (month == 2)
+  {
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return leap ? 29 : 28;
+  }
+
+  return month == 4 || month == 6 || month == 9 || month == 11 ? 30 : 31;
+}
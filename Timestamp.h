@@ -0,0 +1,36 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <stdint.h>
+
+// Epoch seconds are what gets stored; this turns them into UTC calendar
+// fields and ISO-8601 text without localtime() or printf. The last breakdown
+// is cached and moved forward incrementally, so formatting a run of readings
+// only does the full date conversion when it skips more than a day.
+class Timestamp
+{
+  public:
+    static const uint8_t ISO8601_LENGTH = 24;   // YYYY-MM-DDThh:mm:ss.000Z
+
+    struct CALENDAR {
+      uint16_t year;
+      uint8_t month;          // 1-12
+      uint8_t day;            // 1-31
+      uint8_t hour;
+      uint8_t minute;
+      uint8_t second;
+    };
+
+    const CALENDAR& breakdown(uint32_t epoch);
+    void formatIso8601(char* buffer, uint32_t epoch);
+
+    static void formatNumber(char* buffer, uint8_t width, uint32_t value, char pad = '0');
+
+  private:
+    uint32_t _days = 0;       // Days since the epoch of _calendar
+    CALENDAR _calendar = { 1970, 1, 1, 0, 0, 0 };
+
+    static uint8_t daysInMonth(uint16_t year, uint8_t month);
+};
+
+#endif
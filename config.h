@@ -1,7 +1,17 @@
 /* ----------------- General config -------------------------------- */
 /* Particulate Matter Sensor */
-uint32_t    g_pms_warmup_period     = 30;               // Seconds to warm up PMS before reading
+uint32_t    g_pms_warmup_period     = 30;               // Most seconds to warm up PMS before reading
+uint32_t    g_pms_warmup_min_period = 10;               // Seconds before readings are checked for convergence
+uint16_t    g_pms_warmup_tolerance  = 2;                // ug/m3 consecutive readings may differ once warmed up...
+uint8_t     g_pms_warmup_tolerance_pct = 10;            // ...or percent of the reading, whichever is larger
+uint8_t     g_pms_warmup_stable_readings = 3;           // Consecutive agreeing readings that end warm up
 uint32_t    g_pms_report_period     = 120;              // Seconds between reports
+uint8_t     g_pms_samples_per_report = 10;              // Frames summarized into each report (up to 16)
+uint32_t    g_pms_sample_interval   = 1;                // Seconds between frames of a report
+uint32_t    g_backlog_size          = 65536;            // Bytes of flash kept for readings that couldn't be reported
+uint32_t    g_backlog_drain_interval = 15;              // Seconds between uploads of backlogged readings
+uint32_t    g_http_gzip_threshold   = 1024;             // Bytes from which report bodies are gzipped, 0 to never
+uint32_t    g_deep_sleep_min_period = 20;               // Shortest deep sleep worth rebooting and reconnecting for (s)
 char sensor[8]                      = "PMS7003";
 
 #define VERSION                 "0.3.2"
@@ -10,8 +20,38 @@ char sensor[8]                      = "PMS7003";
 #define     SERIAL_BAUD_RATE    115200                // Speed for USB serial console
 
 /* ----------------- Hardware-specific config ---------------------- */
+// Uncomment to talk to the PMS over the hardware UART instead of SoftwareSerial.
+// UART0 is swapped onto GPIO13/GPIO15: wire PMS Tx to D7 and PMS Rx to D8. The
+// console then moves to UART1, which is Tx only, on D4.
+//#define   PMS_HARDWARE_SERIAL
+
 #define     ESP_WAKEUP_PIN          D0               // To reset ESP8266 after deep sleep
+// Uncomment to deep sleep the ESP8266 while the PMS sleeps between reports,
+// keeping readings that wait for their batch in RTC memory. ESP_WAKEUP_PIN
+// must be wired to RST.
+//#define   ESP_DEEP_SLEEP
+#ifdef PMS_HARDWARE_SERIAL
+#define     ESP_FACTORY_RESET       D2               // To factory reset ESP8266 (D7 is PMS Tx)
+#define     CONSOLE                 Serial1          // Console on UART1 Tx (D4)
+#else
 #define     ESP_FACTORY_RESET       D7               // To factory reset ESP8266
 #define     PMS_RX_PIN              D4               // Rx from PMS (== PMS Tx)
 #define     PMS_TX_PIN              D2               // Tx to PMS (== PMS Rx)
+#define     CONSOLE                 Serial           // Console on USB serial
+#endif
 #define     PMS_BAUD_RATE         9600               // PMS5003 uses 9600bps
+
+// Uncomment to replace the PMS with a simulated sensor seeded with this value.
+// A scripted scenario can be put in /scenario.csv (format in PMSFake.cpp), and
+// a capture recorded with PMS_CAPTURE_SIZE in /scenario.cap is played back
+// before it. Frames come at least PMS_FAKE_FRAME_INTERVAL ms apart: in active
+// mode that is their period, in passive mode (which the sketch uses) a read
+// request is answered only once that long has passed since the previous frame,
+// so an interval above PMS::SINGLE_RESPONSE_TIME gives read timeouts. 0 answers
+// at once. The g_pms_* periods are not scaled; shorten them to run faster.
+//#define   PMS_FAKE_SEED           1
+#define     PMS_FAKE_FRAME_INTERVAL 1000
+
+// Uncomment to record the raw PMS frames to /pms.cap for offline replay, up to
+// this many bytes per file. The previous file is kept as /pms.cap.1.
+//#define   PMS_CAPTURE_SIZE        65536
@@ -28,8 +28,22 @@
 #include <LittleFS.h>                 // File System library
 #include <SoftwareSerial.h>           // Allows PMS to avoid the USB serial port
 #include <time.h>                     // To get current time
+#include <sys/time.h>                 // settimeofday(), to restore the time after deep sleep
 #include <WiFiConnect.h>              // Allow configuring WiFi via captive portal
+#include <WiFiUdp.h>                  // UDP for CoAP reports
+#include <coredecls.h>                // crc32(), to check the state kept in RTC memory
+#include <new>                        // std::nothrow, for buffers only needed now and then
 #include "PMS.h"                      // Particulate Matter Sensor driver (embedded)
+#include "PMSAggregate.h"             // Summarizes several PMS frames per report
+#include "PMSCapture.h"               // Records raw PMS frames for offline replay
+#include "PMSFake.h"                  // Simulated PMS for testing without hardware
+#include "MeasurementQueue.h"         // Readings waiting to be reported
+#include "MeasurementLog.h"           // Readings that couldn't be reported, on flash
+#include "MeasurementPayload.h"       // Streamed JSON body of the reports
+#include "Timestamp.h"                // Epoch seconds to calendar and ISO-8601
+#include "GzipPayload.h"              // Compressed report bodies
+#include "CoapClient.h"               // Confirmable CoAP reports over UDP
+#include "MqttClient.h"               // QoS 1 MQTT reports
 
 /*--------------------------- Global Variables ---------------------------*/
 // Particulate matter sensor
@@ -38,6 +52,17 @@
 #define   PMS_STATE_READY         2   // Warmed up, ready to give data
 uint8_t   g_pms_state           = PMS_STATE_WAKING_UP;
 uint32_t  g_pms_state_start     = 0;  // Timestamp when PMS state last changed
+uint32_t  g_pms_sample_start    = 0;  // Timestamp when last frame was requested
+uint32_t  g_pms_wakeup_start    = 0;  // Timestamp when PMS was last woken up
+uint8_t   g_pms_warmup_readings = 0;  // Readings taken during the current warm up
+uint8_t   g_pms_warmup_stable   = 0;  // Consecutive warm up readings that agreed
+PMS::DATA g_pms_warmup_previous;      // Previous reading taken during warm up
+
+uint32_t  g_pms_warmup_last     = 0;  // Duration of the last warm up (ms)
+uint32_t  g_pms_warmup_shortest = 0;  // Shortest warm up so far (ms)
+uint32_t  g_pms_warmup_longest  = 0;  // Longest warm up so far (ms)
+uint32_t  g_pms_warmup_total    = 0;  // Sum of all warm ups so far (ms)
+uint32_t  g_pms_warmup_count    = 0;  // Number of warm ups so far
 uint8_t   g_pms_ae_readings_taken  = false;  // true/false: whether any readings have been taken
 uint8_t   g_pms_ppd_readings_taken = false;  // true/false: whether PPD readings have been taken
 
@@ -58,52 +83,143 @@ uint32_t  g_pm10p0_ppd_value    = 0;  // Particles Per Deciliter pm10.0 reading
 
 // HTTP Server
 #define JSON_BUFFER 256
-char http_data_template[] = "[{"
-                            "\"sensor\": \"%s\","
-                            "\"source\": \"%s\","
-                            "\"version\": \"%s\","
-                            "\"description\": \"%s\","
-                            "\"pm1dot0\": %d,"
-                            "\"pm2dot5\": %d,"
-                            "\"pm10\": %d,"
-                            "\"longitude\": %s,"
-                            "\"latitude\": %s,"
-                            "\"recorded\": \"%s\""
-                            "}]";
+#define TLS_FRAGMENT_LENGTH     512   // Buffer size if the server supports Max Fragment Length
+#define TLS_MFLN_UNKNOWN        0     // Max Fragment Length support of the report server not probed yet
+#define TLS_MFLN_SUPPORTED      1
+#define TLS_MFLN_UNSUPPORTED    2
+uint8_t g_tls_mfln = TLS_MFLN_UNKNOWN;   // Probe result, deep sleep keeps it
+MeasurementPayload g_payload;            // Body of the reports
+bool g_http_gzip_rejected = false;       // Server refused a compressed report, send plain until reboot
+                                         // (deep sleep keeps it)
 
 uint32_t g_device_id;                    // Unique ID from ESP chip ID
+char source[10];                         // g_device_id in hex, as reported
 
 // Time keeping
 time_t now;
-struct tm * timeinfo;
-char recorded_template[]        = "%d-%02d-%02dT%02d:%02d:%02d.000Z";
 
 bool force_configuration_portal = false;
 bool force_params_portal        = false;
 
 #define REMOTE_OTA_TIMEOUT      24 * 60 * 60 * 1000 //Check every 24 hours
 uint32_t  g_remote_ota_last_run = 0;  // Timestamp when last OTA was run
+#define BACKLOG_DRAIN_DELAY_MAX 30 * 60 * 1000 // Wait after failed uploads stops doubling here (ms)
+uint32_t  g_backlog_drain_last = 0;   // Timestamp when the backlog was last sent from
+uint32_t  g_backlog_drain_delay = 0;  // Wait before the next upload after failures, 0 for the interval
+bool      g_backlog_drain_failed = false; // Whether the last upload of the backlog failed
+
+#ifdef ESP_DEEP_SLEEP
+// What deep sleep would otherwise lose, kept in RTC user memory meanwhile
+struct RTC_STATE {
+  uint32_t crc;                       // Of the rest, so a cold boot's garbage isn't restored
+  uint32_t epoch;                     // Time when going to sleep
+  uint32_t sleep_period;              // Sleep requested (ms)
+  uint32_t remote_ota_elapsed;        // Time since the last remote OTA check (ms)
+  uint32_t http_gzip_rejected;
+  uint32_t tls_mfln;
+  uint32_t backlog_drain_elapsed;     // Time since the backlog was last sent from (ms)
+  uint32_t backlog_drain_delay;
+  uint32_t backlog_drain_failed;
+  uint32_t pms_warmup_last;
+  uint32_t pms_warmup_shortest;
+  uint32_t pms_warmup_longest;
+  uint32_t pms_warmup_total;
+  uint32_t pms_warmup_count;
+  uint32_t measurement_count;
+  br_ssl_session_parameters tls_session; // Resumed on the first report after waking up
+  MeasurementQueue::MEASUREMENT measurements[MeasurementQueue::CAPACITY];
+};
+static_assert(sizeof(RTC_STATE) <= 512 && sizeof(RTC_STATE) % 4 == 0, "RTC user memory is 512 bytes, written in words");
+#endif
+
+// MQTT Server
+#define MQTT_RETRY_MIN          1000        // First reconnection delay (ms)
+#define MQTT_RETRY_MAX          5 * 60 * 1000 // Reconnection delay stops doubling here (ms)
+uint32_t  g_mqtt_retry_last     = 0;  // Timestamp when a connection was last attempted
+uint32_t  g_mqtt_retry_delay    = 0;  // Wait before the next attempt, 0 to attempt right away
+
+// CoAP Server: one report at a time is in flight, seen through from loop()
+MeasurementQueue g_coap_readings;     // Copy of the readings being sent
+uint8_t   g_coap_count          = 0;  // How many of them fit in the request
+bool      g_coap_backlog        = false; // Whether they came from the backlog
+uint32_t  g_coap_start          = 0;  // Timestamp when the request was first sent
+char      g_coap_host[64];            // Host of coap_server, and the query with the
+char      g_coap_query[38];           // API key, kept while the request is retransmitted
 
 /*--------------------------- Function Signatures ------------------------*/
 void initFS();
 void initOta();
+void initTls();
 void initNtp();
 void initWifi();
 void handleRemoteOta();
 void updatePmsReadings();
+void queueMeasurement();
+bool batchDue();
+void clampBatchSize();
+void drainBacklog();
+void backlogSent(bool delivered, uint8_t sent);
+void backlogMeasurements();
+void handleDeepSleep();
+void restoreRtcState();
+void handleMqtt();
+bool connectMqtt();
+bool useMqtt();
+bool useCoap();
+bool sendMeasurements(const MeasurementQueue& queue, uint8_t& sent);
+bool postMeasurements(const MeasurementQueue& queue, uint8_t& sent);
+bool publishMeasurements(const MeasurementQueue& queue, uint8_t& sent);
+bool beginCoapMeasurements(const MeasurementQueue& queue, bool backlog);
+void handleCoap();
+bool parseUrlHost(const char* url, char* host, size_t host_size, uint16_t& port);
+const char* parseUrlPath(const char* url);
+int postToHttp(GzipPayload* gzip);
+bool pmsReadingsConverged(const PMS::DATA& previous, const PMS::DATA& current);
+bool pmsValuesConverged(uint16_t previous, uint16_t current);
 
 /*--------------------------- Instantiate Global Objects -----------------*/
+#ifdef PMS_HARDWARE_SERIAL
+// Hardware serial port, swapped to GPIO13/GPIO15 in setup()
+HardwareSerial& pmsSerial = Serial;
+#else
 // Software serial port
 SoftwareSerial pmsSerial(PMS_RX_PIN, PMS_TX_PIN); // Rx pin = GPIO2 (D4 on Wemos D1 Mini)
+#endif
 
 // Particulate matter sensor
-PMS pms(pmsSerial, false);           // Use the software serial port for the PMS
+#ifdef PMS_FAKE_SEED
+PMSFake pmsFake(PMS_FAKE_SEED);      // Simulated sensor, replays /scenario.csv if present
+File g_pms_fake_capture;             // /scenario.cap, played back by pmsFake
+PMS pms(pmsFake);
+#else
+PMS pms(pmsSerial);                  // Use the PMS serial port, whichever transport it is
+#endif
 PMS::DATA g_data;
-
-// Start HTTP client
+PMSAggregate g_pms_aggregate;        // Frames of the current wake window
+PMSAggregate::RESULT g_pms_summary;  // Summary of the last wake window
+MeasurementQueue g_measurements;     // Readings waiting to be reported
+MeasurementLog g_measurement_log(LittleFS, "/backlog", g_backlog_size);
+#ifdef PMS_CAPTURE_SIZE
+PMSCapture pmsCapture(LittleFS, "/pms.cap", PMS_CAPTURE_SIZE);
+#endif
+
+// Start HTTP client, the API connection is kept alive between reports so
+// remote OTA gets its own
 WiFiClientSecure client;
+WiFiClientSecure ota_client;
+BearSSL::Session tls_session;        // Lets reconnects to the API resume the TLS session
 HTTPClient http;
 
+// MQTT client, over `client` for mqtts:// servers or a plain connection for
+// mqtt:// ones, kept connected from loop(). Messages are streamed from
+// g_payload, so it needs no buffers of its own.
+WiFiClient mqtt_plain_client;
+MqttClient mqtt;
+
+// CoAP client, for private deployments that don't need TLS
+WiFiUDP coap_udp;
+CoapClient coap(coap_udp);
+
 // WifiManager
 WiFiConnect wc;
 
@@ -114,6 +230,14 @@ char longitude[12] = "";
 char description[21] = "";
 char api_url[71] = "https://api.airelib.re/api/v1/measurements";
 char ota_server[71] = "https://linka.servin.dev/ota";
+char api_fingerprint[60] = "";
+char batch_size[4] = "1";           // Readings sent per request
+char batch_latency[7] = "600";      // Seconds a reading may wait for its batch
+char api_format[8] = "json";        // Report body, "json", "cbor" or "columns"
+char api_transport[5] = "http";     // Report over "http" (api_url), "mqtt" (mqtt_server) or "coap" (coap_server)
+char mqtt_server[71] = "";          // e.g. mqtts://broker.example.com:8883
+char mqtt_topic[41] = "linka/measurements";
+char coap_server[71] = "";          // e.g. coap://192.168.1.10:5683/measurements
 
 // flag for saving data
 bool shouldSaveConfig = false;
@@ -129,19 +253,19 @@ void saveConfigCallback () {
 
 // Remote OTA callbacks
 void update_started() {
-  Serial.println("CALLBACK:  HTTP update process started");
+  CONSOLE.println("CALLBACK:  HTTP update process started");
 }
 
 void update_finished() {
-  Serial.println("CALLBACK:  HTTP update process finished");
+  CONSOLE.println("CALLBACK:  HTTP update process finished");
 }
 
 void update_progress(int cur, int total) {
-  Serial.printf("CALLBACK:  HTTP update process at %d of %d bytes...\n", cur, total);
+  CONSOLE.printf("CALLBACK:  HTTP update process at %d of %d bytes...\n", cur, total);
 }
 
 void update_error(int err) {
-  Serial.printf("CALLBACK:  HTTP update fatal error code %d\n", err);
+  CONSOLE.printf("CALLBACK:  HTTP update fatal error code %d\n", err);
 }
 
 /*
@@ -149,42 +273,106 @@ void update_error(int err) {
 */
 void setup()
 {
-  Serial.begin(SERIAL_BAUD_RATE);   // GPIO1, GPIO3 (TX/RX pin on ESP-12E Development Board)
+  CONSOLE.begin(SERIAL_BAUD_RATE);  // GPIO1, GPIO3 (TX/RX pin on ESP-12E Development Board) or GPIO2 (UART1)
   delay(100);
-  Serial.println();
-  Serial.print("Linka Air Quality Sensor v");
-  Serial.println(VERSION);
+  CONSOLE.println();
+  CONSOLE.print("Linka Air Quality Sensor v");
+  CONSOLE.println(VERSION);
 
   // Open a connection to the PMS and put it into passive mode
   pmsSerial.begin(PMS_BAUD_RATE);   // Connection for PMS5003
+#ifdef PMS_HARDWARE_SERIAL
+  pmsSerial.swap();                 // Move UART0 from the USB bridge to GPIO13/GPIO15
+#else
+  pmsSerial.onReceive([](int /* available */) {
+    pms.receive();                  // Assemble frames as soon as bytes arrive
+  });
+#endif
   pms.passiveMode();                // Tell PMS to stop sending data automatically
-  delay(100);
   pms.wakeUp();                     // Tell PMS to wake up (turn on fan and laser)
+  pms.flush();                      // Send both now, not once loop() runs after WiFi and NTP
+  g_pms_state_start = millis();     // Warm up starts once the command is out
+  g_pms_wakeup_start = g_pms_state_start;
+
+#ifdef ESP_DEEP_SLEEP
+  // Deep sleep ends when the sensor is due to wake up, so its warm up starts
+  // right away either way
+  restoreRtcState();
+#endif
 
   // Get ESP's unique ID
   g_device_id = ESP.getChipId();  // Get the unique ID of the ESP8266 chip
-  Serial.print("Device ID: ");
-  Serial.println(g_device_id, HEX);
+  CONSOLE.print("Device ID: ");
+  CONSOLE.println(g_device_id, HEX);
+  sprintf(source, "%x", g_device_id);
 
   // Check if we want to factory reset the sensor
   check_reset();
 
   // Ignore SSL certificate, required to use SSL without providing the SSL certificate
-  client.setInsecure();
+  ota_client.setInsecure();
+  http.setReuse(true);
 
   // Initialize File System
   initFS();
 
+#ifdef PMS_FAKE_SEED
+  pmsFake.setFrameInterval(PMS_FAKE_FRAME_INTERVAL);
+
+  // Play back captured frames on the simulated sensor, if there are any
+  g_pms_fake_capture = LittleFS.open("/scenario.cap", "r");
+  if (g_pms_fake_capture) {
+    CONSOLE.printf("Playing back %u captured PMS frames\n", g_pms_fake_capture.size() / sizeof(PMSCapture::RECORD));
+    pmsFake.loadCapture(g_pms_fake_capture);
+  }
+
+  // Replay a scripted scenario on the simulated sensor, if there is one
+  File scenario = LittleFS.open("/scenario.csv", "r");
+  if (scenario) {
+    if (pmsFake.loadScenario(scenario)) {
+      CONSOLE.println("Loaded simulated PMS scenario");
+    } else {
+      CONSOLE.println("Invalid simulated PMS scenario, using default");
+    }
+    scenario.close();
+  }
+#endif
+
+#ifdef PMS_CAPTURE_SIZE
+  // Record every raw frame the parser sees, valid or not
+  pms.onFrame([](const uint8_t* frame, uint8_t length, bool valid) {
+    pmsCapture.append(frame, length, valid);
+  });
+#endif
+
   // Initialize WiFi
   initWifi();
 
+  // Render the parts of the reports that only change with the config
+  MeasurementPayload::FORMAT format = MeasurementPayload::FORMAT_JSON;
+  if (strcmp(api_format, "cbor") == 0) {
+    format = MeasurementPayload::FORMAT_CBOR;
+  } else if (strcmp(api_format, "columns") == 0) {
+    format = MeasurementPayload::FORMAT_COLUMNS;
+  }
+  g_payload.setDevice(sensor, source, VERSION, description, longitude, latitude, format);
+
+  // Message IDs start at random, so the server doesn't take the first reports
+  // after a reboot for retransmissions
+  if (useCoap()) {
+    coap.begin(ESP.random());
+  }
+
+  // Initialize TLS for the API connection
+  initTls();
+
   // Initialize OTA
   initOta();
 
   // Initialize NTP
   initNtp();
 
-  Serial.println("Sensor configured correctly...");
+  CONSOLE.println("Sensor configured correctly...");
 }
 
 /*
@@ -206,7 +394,23 @@ void loop()
     WiFi.persistent(false);
   }
 
+  pms.handle();                     // Send any queued PMS commands
   updatePmsReadings();
+
+  if (WiFi.status() == WL_CONNECTED) {
+    if (useMqtt()) {
+      handleMqtt();                 // Keep the broker connection up
+    }
+    handleCoap();                   // See the CoAP report in flight through
+    if (batchDue()) {
+      reportMeasurements();         // Latency ran out while waiting for readings
+    }
+    drainBacklog();                 // Catch up on readings that couldn't be reported
+  }
+
+#ifdef ESP_DEEP_SLEEP
+  handleDeepSleep();                // Power down until the sensor is due to wake up
+#endif
 }
 
 /*
@@ -218,70 +422,173 @@ void updatePmsReadings() {
   // Check if we've been in the sleep state for long enough
   if (PMS_STATE_ASLEEP == g_pms_state)
   {
-    if (time_now - g_pms_state_start
-        >= ((g_pms_report_period * 1000) - (g_pms_warmup_period * 1000)))
+    // Wake up once per report period, however long warm up took last time
+    if (time_now - g_pms_wakeup_start
+        >= (g_pms_report_period * 1000))
     {
       // It's time to wake up the sensor
-      Serial.println("Waking up sensor");
+      CONSOLE.println("Waking up sensor");
       pms.wakeUp();
       g_pms_state_start = time_now;
+      g_pms_wakeup_start = time_now;
+      g_pms_warmup_readings = 0;
+      g_pms_warmup_stable = 0;
       g_pms_state = PMS_STATE_WAKING_UP;
     }
   }
 
-  // Check if we've been in the waking up state for long enough
+  // Check if the readings have settled, or we've been in the waking up state
+  // for long enough
   if (PMS_STATE_WAKING_UP == g_pms_state)
   {
-    if (time_now - g_pms_state_start
-        >= (g_pms_warmup_period * 1000))
+    bool warmed_up = time_now - g_pms_state_start >= (g_pms_warmup_period * 1000);
+
+    if (!warmed_up && time_now - g_pms_state_start >= (g_pms_warmup_min_period * 1000))
     {
+      PMS::READ_STATUS read_status = pms.pollRead(g_data);
+      if (PMS::READ_IDLE == read_status)
+      {
+        if (time_now - g_pms_sample_start >= (g_pms_sample_interval * 1000))
+        {
+          g_pms_sample_start = time_now;
+          pms.beginRead();
+        }
+      }
+      else if (PMS::READ_OK == read_status)
+      {
+        if (g_pms_warmup_readings > 0 && pmsReadingsConverged(g_pms_warmup_previous, g_data))
+        {
+          g_pms_warmup_stable++;
+        }
+        else
+        {
+          g_pms_warmup_stable = 0;
+        }
+        g_pms_warmup_readings++;
+        g_pms_warmup_previous = g_data;
+
+        warmed_up = g_pms_warmup_stable >= g_pms_warmup_stable_readings;
+      }
+    }
+
+    if (warmed_up)
+    {
+      // Keep track of how long the sensor actually needs to warm up
+      g_pms_warmup_last = time_now - g_pms_state_start;
+      g_pms_warmup_total += g_pms_warmup_last;
+      g_pms_warmup_count++;
+      if (1 == g_pms_warmup_count || g_pms_warmup_last < g_pms_warmup_shortest)
+      {
+        g_pms_warmup_shortest = g_pms_warmup_last;
+      }
+      if (g_pms_warmup_last > g_pms_warmup_longest)
+      {
+        g_pms_warmup_longest = g_pms_warmup_last;
+      }
+      CONSOLE.printf("Sensor ready after %u ms of warm up, shortest/average/longest: %u/%u/%u ms\n",
+                     g_pms_warmup_last,
+                     g_pms_warmup_shortest,
+                     g_pms_warmup_total / g_pms_warmup_count,
+                     g_pms_warmup_longest);
+
       g_pms_state_start = time_now;
       g_pms_state = PMS_STATE_READY;
+      g_pms_aggregate.reset();
     }
   }
 
-  // Put the most recent values into globals for reference elsewhere
+  // Collect the frames of this wake window, then put their summary into
+  // globals for reference elsewhere
   if (PMS_STATE_READY == g_pms_state)
   {
-    //Serial.println("Sensor is Ready");
-    //pms.requestRead();
-    if (pms.readUntil(g_data))  // Use a blocking road to make sure we get values
+    // Request frames one at a time and collect them on later iterations, so
+    // OTA and WiFi housekeeping keep running while the sensor answers
+    uint32_t frame_millis;
+    PMS::READ_STATUS read_status = pms.pollRead(g_data, frame_millis);
+    if (PMS::READ_IDLE == read_status)
     {
-      // Get current time of reading
+      // Space requests out so every sample is a fresh reading
+      if (0 == g_pms_aggregate.count()
+          || time_now - g_pms_sample_start >= (g_pms_sample_interval * 1000))
+      {
+        g_pms_sample_start = time_now;
+        pms.beginRead();
+      }
+    }
+    else if (PMS::READ_TIMEOUT == read_status)
+    {
+      CONSOLE.println("PMS: No response from sensor, retrying");
+    }
+    else if (PMS::READ_OK == read_status)
+    {
+      g_pms_aggregate.add(g_data);
 
+      // Get time the frame was received by the driver, not time it got here
       time(&now);
-      timeinfo = localtime(&now);
-
-      g_pm1p0_sp_value   = g_data.PM_SP_UG_1_0;
-      g_pm2p5_sp_value   = g_data.PM_SP_UG_2_5;
-      g_pm10p0_sp_value  = g_data.PM_SP_UG_10_0;
+      now -= (millis() - frame_millis) / 1000;
+    }
 
-      g_pm1p0_ae_value   = g_data.PM_AE_UG_1_0;
-      g_pm2p5_ae_value   = g_data.PM_AE_UG_2_5;
-      g_pm10p0_ae_value  = g_data.PM_AE_UG_10_0;
+    // Report once the window is complete, or with what we have if the sensor
+    // stopped answering
+    uint8_t samples = g_pms_aggregate.count();
+    if (samples >= g_pms_samples_per_report
+        || samples == PMSAggregate::MAX_SAMPLES
+        || (samples > 0 && time_now - g_pms_state_start
+            >= (g_pms_samples_per_report * g_pms_sample_interval * 1000) + PMS::TOTAL_RESPONSE_TIME))
+    {
+      g_pms_aggregate.summarize(g_pms_summary);
+      PMS::DATA& median = g_pms_summary.median;
+      CONSOLE.printf("PMS: %u frames, PM2.5 SP min/mean/median/max: %u/%u/%u/%u\n",
+                     samples,
+                     g_pms_summary.min.PM_SP_UG_2_5,
+                     g_pms_summary.mean.PM_SP_UG_2_5,
+                     median.PM_SP_UG_2_5,
+                     g_pms_summary.max.PM_SP_UG_2_5);
+
+      g_pm1p0_sp_value   = median.PM_SP_UG_1_0;
+      g_pm2p5_sp_value   = median.PM_SP_UG_2_5;
+      g_pm10p0_sp_value  = median.PM_SP_UG_10_0;
+
+      g_pm1p0_ae_value   = median.PM_AE_UG_1_0;
+      g_pm2p5_ae_value   = median.PM_AE_UG_2_5;
+      g_pm10p0_ae_value  = median.PM_AE_UG_10_0;
 
       g_pms_ae_readings_taken = true;
 
       // This condition below should NOT be required, but currently I get all
       // 0 values for the PPD results every second time. This check only updates
       // the global values if there is a non-zero result for any of the values:
-      if (g_data.PM_TOTALPARTICLES_0_3 + g_data.PM_TOTALPARTICLES_0_5
-          + g_data.PM_TOTALPARTICLES_1_0 + g_data.PM_TOTALPARTICLES_2_5
-          + g_data.PM_TOTALPARTICLES_5_0 + g_data.PM_TOTALPARTICLES_10_0
+      if (median.PM_TOTALPARTICLES_0_3 + median.PM_TOTALPARTICLES_0_5
+          + median.PM_TOTALPARTICLES_1_0 + median.PM_TOTALPARTICLES_2_5
+          + median.PM_TOTALPARTICLES_5_0 + median.PM_TOTALPARTICLES_10_0
           != 0)
       {
-        g_pm0p3_ppd_value  = g_data.PM_TOTALPARTICLES_0_3;
-        g_pm0p5_ppd_value  = g_data.PM_TOTALPARTICLES_0_5;
-        g_pm1p0_ppd_value  = g_data.PM_TOTALPARTICLES_1_0;
-        g_pm2p5_ppd_value  = g_data.PM_TOTALPARTICLES_2_5;
-        g_pm5p0_ppd_value  = g_data.PM_TOTALPARTICLES_5_0;
-        g_pm10p0_ppd_value = g_data.PM_TOTALPARTICLES_10_0;
+        g_pm0p3_ppd_value  = median.PM_TOTALPARTICLES_0_3;
+        g_pm0p5_ppd_value  = median.PM_TOTALPARTICLES_0_5;
+        g_pm1p0_ppd_value  = median.PM_TOTALPARTICLES_1_0;
+        g_pm2p5_ppd_value  = median.PM_TOTALPARTICLES_2_5;
+        g_pm5p0_ppd_value  = median.PM_TOTALPARTICLES_5_0;
+        g_pm10p0_ppd_value = median.PM_TOTALPARTICLES_10_0;
         g_pms_ppd_readings_taken = true;
       }
       pms.sleep();
+      pms.flush();                  // Don't leave the fan running during the upload
+
+      // Parser health since boot
+      PMS::STATS stats = pms.stats();
+      CONSOLE.printf("PMS bytes: %u, frames: %u, checksum errors: %u, resyncs: %u, "
+                     "length errors: %u, timeouts: %u, parse time: %u us, last frame: %u us\n",
+                     stats.bytesRead,
+                     stats.framesAccepted,
+                     stats.checksumErrors,
+                     stats.resyncs,
+                     stats.lengthErrors,
+                     stats.timeouts,
+                     stats.parseMicros,
+                     stats.frameMicros);
 
       // Report the new values
-      reportToHttp();
+      queueMeasurement();
       //reportToSerial();
 
       g_pms_state_start = time_now;
@@ -291,58 +598,535 @@ void updatePmsReadings() {
 }
 
 /*
-  Report the latest values to HTTP Server
+  Check if two consecutive readings agree within the warm up tolerance
 */
-void reportToHttp()
+bool pmsReadingsConverged(const PMS::DATA& previous, const PMS::DATA& current)
 {
-  char measurements[256];
-  char recorded[27];
-  char source[10];
+  return pmsValuesConverged(previous.PM_SP_UG_1_0, current.PM_SP_UG_1_0)
+         && pmsValuesConverged(previous.PM_SP_UG_2_5, current.PM_SP_UG_2_5)
+         && pmsValuesConverged(previous.PM_SP_UG_10_0, current.PM_SP_UG_10_0);
+}
 
-  sprintf(recorded,
-          recorded_template,
-          timeinfo->tm_year + 1900,
-          timeinfo->tm_mon + 1,
-          timeinfo->tm_mday,
-          timeinfo->tm_hour,
-          timeinfo->tm_min,
-          timeinfo->tm_sec);
-  sprintf(source, "%x", g_device_id);
-  sprintf(measurements,
-          http_data_template,
-          sensor,
-          source,
-          VERSION,
-          description,
-          g_pm1p0_sp_value,
-          g_pm2p5_sp_value,
-          g_pm10p0_sp_value,
-          longitude,
-          latitude,
-          recorded);
-  Serial.println(measurements);
-
-  if (http.begin(client, api_url)) {
-
-    // Add headers
-    http.addHeader("x-api-key", api_key);
-    http.addHeader("Content-Type", "application/json");
-    int httpCode = http.POST(measurements);
-
-    // httpCode will be negative on error
-    if (httpCode > 0) {
-      // HTTP header has been sent and Server response header has been handled
-      Serial.printf("[HTTP] POST... code: %d\n", httpCode);
+bool pmsValuesConverged(uint16_t previous, uint16_t current)
+{
+  uint16_t difference = previous > current ? previous - current : current - previous;
+  uint32_t tolerance  = (uint32_t)max(previous, current) * g_pms_warmup_tolerance_pct / 100;
+
+  return difference <= max(tolerance, (uint32_t)g_pms_warmup_tolerance);
+}
+
+/*
+  Report the queued values to the HTTP, MQTT or CoAP Server, moving whatever
+  can't be delivered to the backlog on flash. CoAP reports only start here,
+  handleCoap() sees them through.
+*/
+void reportMeasurements()
+{
+  if (useCoap()) {
+    // While a report is in flight the readings wait in the queue
+    if (coap.busy()) {
+      return;
+    }
+    if (beginCoapMeasurements(g_measurements, false)) {
+      g_measurements.pop(g_coap_count);
     } else {
-      Serial.printf("[HTTP] POST... failed, error: %s\n", http.errorToString(httpCode).c_str());
+      backlogMeasurements();
     }
-    http.end();
+    return;
   }
-  else {
-    Serial.printf("[HTTP] Unable to connect");
+
+  while (g_measurements.count() > 0)
+  {
+    uint8_t sent;
+    if (!sendMeasurements(g_measurements, sent)) {
+      backlogMeasurements();
+      break;
+    }
+    g_measurements.pop(sent);
+  }
+}
+
+/*
+  Move the queued values to the backlog on flash
+*/
+void backlogMeasurements()
+{
+  while (g_measurements.count() > 0) {
+    g_measurement_log.append(g_measurements.at(0));
+    g_measurements.pop(1);
+  }
+  CONSOLE.printf("Readings kept for later, %u in the backlog\n", g_measurement_log.count());
+}
+
+/*
+  Send the backlog left by failed reports, one request at a time and only
+  while the sensor sleeps, so catching up never delays live sampling
+*/
+void drainBacklog()
+{
+  static MeasurementQueue::MEASUREMENT measurements[MeasurementLog::MAX_READ];
+  static MeasurementQueue backlog;
+  uint32_t time_now = millis();
+
+  if (PMS_STATE_ASLEEP != g_pms_state
+      || g_measurements.count() > 0
+      || 0 == g_measurement_log.count()
+      || coap.busy()
+      || time_now - g_backlog_drain_last < max(g_backlog_drain_delay, g_backlog_drain_interval * 1000))
+  {
+    return;
+  }
+  g_backlog_drain_last = time_now;
+
+  uint8_t count = g_measurement_log.read(measurements, MeasurementLog::MAX_READ);
+  backlog.pop(backlog.count());
+  for (uint8_t i = 0; i < count; i++) {
+    backlog.push(measurements[i]);
+  }
+
+  // Over CoAP, handleCoap() reports back once the request is done
+  if (useCoap()) {
+    if (count == 0 || !beginCoapMeasurements(backlog, true)) {
+      backlogSent(false, 0);
+    }
+    return;
+  }
+
+  uint8_t sent = 0;
+  backlogSent(count > 0 && sendMeasurements(backlog, sent), sent);
+}
+
+/*
+  Take the first `sent` readings of the last drainBacklog() off the backlog
+  if they were delivered, or back off before the next attempt
+*/
+void backlogSent(bool delivered, uint8_t sent)
+{
+  g_backlog_drain_failed = !delivered;
+  if (delivered) {
+    g_measurement_log.consume(sent);
+    g_backlog_drain_delay = 0;
+    CONSOLE.printf("Sent %u backlogged readings, %u left\n", sent, g_measurement_log.count());
+    return;
+  }
+
+  // A failed upload can take a while, e.g. CoAP retransmitting for up to a
+  // minute, so don't keep trying at the full rate while the server is
+  // unreachable
+  g_backlog_drain_delay = min(max(g_backlog_drain_delay, g_backlog_drain_interval * 1000) * 2,
+                              (uint32_t)(BACKLOG_DRAIN_DELAY_MAX));
+  CONSOLE.printf("Backlog upload failed, retrying in %u s\n", g_backlog_drain_delay / 1000);
+}
+
+#ifdef ESP_DEEP_SLEEP
+/*
+  Deep sleep the ESP until the sensor is due to wake up again, once nothing
+  is left to do this cycle: the sensor is asleep, no CoAP report is in flight,
+  and the backlog is sent or can't be. Readings still waiting for their batch,
+  the time, the timers and the TLS session are kept in RTC memory, and the
+  reset on ESP_WAKEUP_PIN boots us again.
+*/
+void handleDeepSleep()
+{
+  uint32_t awake = millis() - g_pms_wakeup_start;
+
+  if (PMS_STATE_ASLEEP != g_pms_state
+      || coap.busy()
+      || awake + (g_deep_sleep_min_period * 1000) >= (g_pms_report_period * 1000)
+      || (g_measurement_log.count() > 0 && 0 == g_measurements.count() && !g_backlog_drain_failed))
+  {
+    return;
+  }
+
+  RTC_STATE state;
+  time(&now);
+  state.epoch = now;
+  state.sleep_period = (g_pms_report_period * 1000) - awake;
+  state.remote_ota_elapsed = millis() - g_remote_ota_last_run;
+  state.http_gzip_rejected = g_http_gzip_rejected;
+  state.tls_mfln = g_tls_mfln;
+  state.backlog_drain_elapsed = millis() - g_backlog_drain_last;
+  state.backlog_drain_delay = g_backlog_drain_delay;
+  state.backlog_drain_failed = g_backlog_drain_failed;
+  state.pms_warmup_last = g_pms_warmup_last;
+  state.pms_warmup_shortest = g_pms_warmup_shortest;
+  state.pms_warmup_longest = g_pms_warmup_longest;
+  state.pms_warmup_total = g_pms_warmup_total;
+  state.pms_warmup_count = g_pms_warmup_count;
+  state.measurement_count = g_measurements.count();
+  memcpy(&state.tls_session, tls_session.getSession(), sizeof(state.tls_session));
+  for (uint8_t i = 0; i < g_measurements.count(); i++) {
+    state.measurements[i] = g_measurements.at(i);
+  }
+  state.crc = crc32((uint8_t*)&state + sizeof(state.crc), sizeof(state) - sizeof(state.crc));
+  ESP.rtcUserMemoryWrite(0, (uint32_t*)&state, sizeof(state));
+
+  // Nothing buffered may be lost with the RAM
+#ifdef PMS_CAPTURE_SIZE
+  pmsCapture.flush();
+#endif
+  g_measurement_log.flush();
+  if (mqtt.connected()) {
+    mqtt.disconnect();
+  }
+  client.stop();
+
+  CONSOLE.printf("Deep sleep for %u ms after %u ms awake, %u readings kept\n",
+                 state.sleep_period, awake, state.measurement_count);
+  CONSOLE.flush();
+  ESP.deepSleep(state.sleep_period * 1000ULL);
+}
+
+/*
+  Pick up where the last cycle left off, if we're waking from deep sleep
+*/
+void restoreRtcState()
+{
+  RTC_STATE state;
+  if (ESP.getResetInfoPtr()->reason != REASON_DEEP_SLEEP_AWAKE
+      || !ESP.rtcUserMemoryRead(0, (uint32_t*)&state, sizeof(state))
+      || state.crc != crc32((uint8_t*)&state + sizeof(state.crc), sizeof(state) - sizeof(state.crc)))
+  {
+    return;
+  }
+
+  // Good enough to time stamp readings until NTP answers
+  struct timeval tv = { (time_t)(state.epoch + (state.sleep_period + millis()) / 1000), 0 };
+  settimeofday(&tv, nullptr);
+
+  g_remote_ota_last_run = millis() - (state.remote_ota_elapsed + state.sleep_period);
+  g_http_gzip_rejected = state.http_gzip_rejected;
+  g_tls_mfln = state.tls_mfln;
+  g_backlog_drain_last = millis() - (state.backlog_drain_elapsed + state.sleep_period);
+  g_backlog_drain_delay = state.backlog_drain_delay;
+  g_backlog_drain_failed = state.backlog_drain_failed;
+  memcpy(tls_session.getSession(), &state.tls_session, sizeof(state.tls_session));
+  g_pms_warmup_last = state.pms_warmup_last;
+  g_pms_warmup_shortest = state.pms_warmup_shortest;
+  g_pms_warmup_longest = state.pms_warmup_longest;
+  g_pms_warmup_total = state.pms_warmup_total;
+  g_pms_warmup_count = state.pms_warmup_count;
+  for (uint32_t i = 0; i < state.measurement_count && i < MeasurementQueue::CAPACITY; i++) {
+    g_measurements.push(state.measurements[i]);
+  }
+
+  CONSOLE.printf("Woke up from deep sleep, %u readings restored\n", g_measurements.count());
+}
+#endif
+
+/*
+  Send the readings of `queue` over the configured transport. Returns true if
+  they were delivered, `sent` tells how many.
+*/
+bool sendMeasurements(const MeasurementQueue& queue, uint8_t& sent)
+{
+  if (useMqtt()) {
+    return publishMeasurements(queue, sent);
+  }
+  return postMeasurements(queue, sent);
+}
+
+/*
+  POST the readings of `queue` as a single JSON array, streamed to the socket
+  as it is generated. Returns true if the server accepted them, `sent` tells
+  how many.
+*/
+bool postMeasurements(const MeasurementQueue& queue, uint8_t& sent)
+{
+  g_payload.begin(queue, queue.count());
+  CONSOLE.printf("[HTTP] Posting %u readings, %u bytes\n", queue.count(), g_payload.size());
+
+  // Large bodies, e.g. when catching up on the backlog, go out compressed.
+  // The compressor's buffers are only taken from the heap for them.
+  std::unique_ptr<GzipPayload> gzip;
+  if (g_http_gzip_threshold > 0 && g_payload.size() >= g_http_gzip_threshold && !g_http_gzip_rejected) {
+    gzip.reset(new (std::nothrow) GzipPayload());
+    if (gzip) {
+      uint32_t compress_start = micros();
+      gzip->begin(g_payload);
+      CONSOLE.printf("[HTTP] Compressed to %u bytes in %u us\n", gzip->size(), micros() - compress_start);
+    } else {
+      CONSOLE.println("[HTTP] Not enough memory to compress the report, sending it uncompressed");
+    }
+  }
+
+  uint32_t start = millis();
+  bool reused = client.connected();
+  int httpCode = postToHttp(gzip.get());
+
+  // The server may have dropped a kept-alive connection without us noticing,
+  // so retry once on a fresh one
+  if (httpCode < 0 && reused) {
+    CONSOLE.println("[HTTP] Kept-alive connection lost, reconnecting");
+    client.stop();
+    httpCode = postToHttp(gzip.get());
+  }
+
+  // Not every server takes a Content-Encoding on requests. 415 says so, a
+  // 400 may be about the readings instead: only if the same report goes
+  // through uncompressed is compression given up, from now on.
+  if (gzip && (httpCode == HTTP_CODE_BAD_REQUEST || httpCode == HTTP_CODE_UNSUPPORTED_MEDIA_TYPE)) {
+    CONSOLE.println("[HTTP] Server refused the compressed report, sending it uncompressed");
+    bool unsupported = httpCode == HTTP_CODE_UNSUPPORTED_MEDIA_TYPE;
+    httpCode = postToHttp(nullptr);
+    if (unsupported || (httpCode >= 200 && httpCode < 300)) {
+      CONSOLE.println("[HTTP] Reports go uncompressed from now on");
+      g_http_gzip_rejected = true;
+    }
+  }
+  CONSOLE.printf("[HTTP] Report of %u readings took %u ms on a %s connection, free heap: %u, largest block: %u\n",
+                 queue.count(), millis() - start, reused ? "reused" : "new", ESP.getFreeHeap(), ESP.getMaxFreeBlockSize());
+
+  sent = queue.count();
+  return httpCode >= 200 && httpCode < 300;
+}
+
+/*
+  Queue the latest values, and report the queue once it holds a full batch or
+  its oldest reading has waited long enough
+*/
+void queueMeasurement()
+{
+  MeasurementQueue::MEASUREMENT measurement = {
+    (uint32_t)now, g_pm1p0_sp_value, g_pm2p5_sp_value, g_pm10p0_sp_value
+  };
+  if (!g_measurements.push(measurement)) {
+    CONSOLE.println("Measurement queue full, dropped the oldest reading");
+  }
+
+  if (batchDue()) {
+    reportMeasurements();
+  }
+}
+
+/*
+  Whether the queue holds a full batch, or its oldest reading has waited
+  batch_latency seconds
+*/
+bool batchDue()
+{
+  if (g_measurements.count() == 0) {
+    return false;
+  }
+
+  return g_measurements.count() >= (uint32_t)atoi(batch_size)
+         || (uint32_t)time(nullptr) - g_measurements.at(0).recorded >= (uint32_t)atoi(batch_latency);
+}
+
+/*
+  Keep batch_size within what the measurement queue holds
+*/
+void clampBatchSize()
+{
+  int size = atoi(batch_size);
+  size = constrain(size, 1, (int)MeasurementQueue::CAPACITY);
+  snprintf(batch_size, sizeof(batch_size), "%d", size);
+}
+
+/*
+  POST g_payload to the HTTP Server, as compressed by `gzip` unless that is
+  null, keeping the connection open for the next report if the server allows it
+*/
+int postToHttp(GzipPayload* gzip)
+{
+  if (!http.begin(client, api_url)) {
+    CONSOLE.println("[HTTP] Unable to connect");
+    return HTTPC_ERROR_CONNECTION_FAILED;
+  }
+
+  // Add headers
+  http.addHeader("x-api-key", api_key);
+  http.addHeader("Content-Type", g_payload.contentType());
+
+  int httpCode;
+  if (gzip) {
+    http.addHeader("Content-Encoding", "gzip");
+    gzip->rewind();
+    httpCode = http.sendRequest("POST", gzip, gzip->size());
+  } else {
+    g_payload.rewind();
+    httpCode = http.sendRequest("POST", &g_payload, g_payload.size());
+  }
+
+  // httpCode will be negative on error
+  if (httpCode > 0) {
+    // HTTP header has been sent and Server response header has been handled
+    CONSOLE.printf("[HTTP] POST... code: %d\n", httpCode);
+  } else {
+    CONSOLE.printf("[HTTP] POST... failed, error: %s\n", http.errorToString(httpCode).c_str());
+  }
+
+  // Closes the connection only if it can't be reused
+  http.end();
+  return httpCode;
+}
+
+/*
+  Whether reports go to the MQTT Server instead of the HTTP Server
+*/
+bool useMqtt()
+{
+  return strcmp(api_transport, "mqtt") == 0;
+}
+
+/*
+  Whether reports go to the CoAP Server instead of the HTTP Server
+*/
+bool useCoap()
+{
+  return strcmp(api_transport, "coap") == 0;
+}
+
+/*
+  Start a confirmable CoAP POST of as many of the oldest readings of `queue`
+  as fit in one datagram, from the backlog or not; g_coap_count tells how
+  many. handleCoap() sees it through. Returns false if it couldn't be sent.
+*/
+bool beginCoapMeasurements(const MeasurementQueue& queue, bool backlog)
+{
+  uint16_t port;
+  if (!parseUrlHost(coap_server, g_coap_host, sizeof(g_coap_host), port)) {
+    CONSOLE.println("[CoAP] Invalid server");
+    return false;
+  }
+
+  // Retransmissions are generated again, from readings that mustn't change
+  // meanwhile
+  g_coap_readings.pop(g_coap_readings.count());
+  for (uint8_t i = 0; i < queue.count(); i++) {
+    g_coap_readings.push(queue.at(i));
+  }
+  g_coap_count = g_coap_readings.count();
+  g_payload.begin(g_coap_readings, g_coap_count);
+  while (g_coap_count > 1 && g_payload.size() > CoapClient::MAX_PAYLOAD) {
+    g_payload.begin(g_coap_readings, --g_coap_count);
+  }
+  CONSOLE.printf("[CoAP] Posting %u readings, %u bytes\n", g_coap_count, g_payload.size());
+
+  sprintf(g_coap_query, "key=%s", api_key);
+  g_coap_backlog = backlog;
+  g_coap_start = millis();
+  if (!coap.beginPost(g_coap_host, port, parseUrlPath(coap_server), g_coap_query, g_payload)) {
+    CONSOLE.println("[CoAP] POST... failed to send");
+    return false;
+  }
+  return true;
+}
+
+/*
+  Poll the CoAP report in flight, and once it is done, deal with its readings
+  the way reportMeasurements() or drainBacklog() would have
+*/
+void handleCoap()
+{
+  if (!coap.busy()) {
+    return;
+  }
+
+  int code = coap.pollPost();
+  if (CoapClient::PENDING == code) {
+    return;
+  }
+  CONSOLE.printf("[CoAP] POST... code: %d after %u retransmissions, took %u ms\n",
+                 code, coap.retransmissions(), millis() - g_coap_start);
+  bool delivered = code >= 200 && code < 300;
+
+  if (g_coap_backlog) {
+    backlogSent(delivered, g_coap_count);
+  } else if (!delivered) {
+    for (uint8_t i = 0; i < g_coap_count; i++) {
+      g_measurement_log.append(g_coap_readings.at(i));
+    }
+    backlogMeasurements();
+  } else if (g_measurements.count() > 0) {
+    reportMeasurements();           // The rest of the queue didn't fit
+  }
+}
+
+/*
+  Keep the connection to the MQTT Server open, retrying with exponential
+  backoff while the broker can't be reached
+*/
+void handleMqtt()
+{
+  if (mqtt.connected()) {
+    mqtt.loop();                    // Keep alive
+    return;
+  }
+
+  uint32_t time_now = millis();
+  if (g_mqtt_retry_delay > 0 && time_now - g_mqtt_retry_last < g_mqtt_retry_delay) {
+    return;
+  }
+  g_mqtt_retry_last = time_now;
+
+  if (connectMqtt()) {
+    g_mqtt_retry_delay = 0;
+  } else {
+    g_mqtt_retry_delay = g_mqtt_retry_delay == 0 ? MQTT_RETRY_MIN : min(g_mqtt_retry_delay * 2, (uint32_t)(MQTT_RETRY_MAX));
+    CONSOLE.printf("[MQTT] Retrying in %u s\n", g_mqtt_retry_delay / 1000);
   }
 }
 
+/*
+  Connect to the MQTT Server, over TLS for mqtts:// servers. The device ID
+  and API key are the credentials.
+*/
+bool connectMqtt()
+{
+  char host[64];
+  uint16_t port;
+  if (!parseUrlHost(mqtt_server, host, sizeof(host), port)) {
+    CONSOLE.println("[MQTT] Invalid server");
+    return false;
+  }
+
+  if (strncmp(mqtt_server, "mqtts://", 8) == 0) {
+    mqtt.begin(client);
+  } else {
+    mqtt.begin(mqtt_plain_client);
+  }
+
+  char client_id[16];
+  sprintf(client_id, "linka-%s", source);
+
+  uint32_t start = millis();
+  int code = mqtt.connect(host, port, client_id, source, api_key);
+  CONSOLE.printf("[MQTT] Connecting to %s:%u %s in %u ms, code: %d\n",
+                 host, port, code == 0 ? "succeeded" : "failed", millis() - start, code);
+  return code == 0;
+}
+
+/*
+  Publish the readings of `queue` as one message on mqtt_topic, at QoS 1.
+  Returns true once the broker has acknowledged it, `sent` tells how many
+  readings it held.
+*/
+bool publishMeasurements(const MeasurementQueue& queue, uint8_t& sent)
+{
+  if (!mqtt.connected()) {
+    CONSOLE.println("[MQTT] Not connected");
+    return false;
+  }
+
+  uint8_t count = queue.count();
+  g_payload.begin(queue, count);
+  CONSOLE.printf("[MQTT] Publishing %u readings, %u bytes\n", count, g_payload.size());
+
+  // publish() waits for the PUBACK, and closes the connection if it doesn't
+  // come even after a retransmission
+  uint32_t start = millis();
+  int code = mqtt.publish(mqtt_topic, g_payload);
+  if (code != 0) {
+    CONSOLE.printf("[MQTT] Publish failed, error: %d\n", code);
+  }
+  CONSOLE.printf("[MQTT] Report of %u readings took %u ms, %u retransmissions, free heap: %u, largest block: %u\n",
+                 count, millis() - start, mqtt.retransmissions(), ESP.getFreeHeap(), ESP.getMaxFreeBlockSize());
+
+  sent = count;
+  return code == 0;
+}
+
 /*
   Report the latest values to the serial console
 */
@@ -351,49 +1135,55 @@ void reportToSerial()
   if (true == g_pms_ae_readings_taken)
   {
     /* Report PM1.0 AE value */
-    Serial.print("PM1:");
-    Serial.print(String(g_pm1p0_ae_value));
-    Serial.print(" | SP:");
-    Serial.println(String(g_pm1p0_sp_value));
+    CONSOLE.print("PM1:");
+    CONSOLE.print(String(g_pm1p0_ae_value));
+    CONSOLE.print(" | SP:");
+    CONSOLE.println(String(g_pm1p0_sp_value));
 
     /* Report PM2.5 AE value */
-    Serial.print("PM2.5:");
-    Serial.print(String(g_pm2p5_ae_value));
-    Serial.print(" | SP:");
-    Serial.println(String(g_pm2p5_sp_value));
+    CONSOLE.print("PM2.5:");
+    CONSOLE.print(String(g_pm2p5_ae_value));
+    CONSOLE.print(" | SP:");
+    CONSOLE.println(String(g_pm2p5_sp_value));
 
     /* Report PM10.0 AE value */
-    Serial.print("PM10:");
-    Serial.print(String(g_pm10p0_ae_value));
-    Serial.print(" | SP:");
-    Serial.println(String(g_pm10p0_sp_value));
+    CONSOLE.print("PM10:");
+    CONSOLE.print(String(g_pm10p0_ae_value));
+    CONSOLE.print(" | SP:");
+    CONSOLE.println(String(g_pm10p0_sp_value));
   }
 
+  /* Report readings waiting on flash */
+  CONSOLE.printf("Backlog waiting/dropped/corrupted: %u/%u/%u\n",
+                 g_measurement_log.count(),
+                 g_measurement_log.dropped(),
+                 g_measurement_log.corrupted());
+
   if (true == g_pms_ppd_readings_taken)
   {
     /* Report PM0.3 PPD value */
-    Serial.print("PB0.3:");
-    Serial.println(String(g_pm0p3_ppd_value));
+    CONSOLE.print("PB0.3:");
+    CONSOLE.println(String(g_pm0p3_ppd_value));
 
     /* Report PM0.5 PPD value */
-    Serial.print("PB0.5:");
-    Serial.println(String(g_pm0p5_ppd_value));
+    CONSOLE.print("PB0.5:");
+    CONSOLE.println(String(g_pm0p5_ppd_value));
 
     /* Report PM1.0 PPD value */
-    Serial.print("PB1:");
-    Serial.println(String(g_pm1p0_ppd_value));
+    CONSOLE.print("PB1:");
+    CONSOLE.println(String(g_pm1p0_ppd_value));
 
     /* Report PM2.5 PPD value */
-    Serial.print("PB2.5:");
-    Serial.println(String(g_pm2p5_ppd_value));
+    CONSOLE.print("PB2.5:");
+    CONSOLE.println(String(g_pm2p5_ppd_value));
 
     /* Report PM5.0 PPD value */
-    Serial.print("PB5:");
-    Serial.println(String(g_pm5p0_ppd_value));
+    CONSOLE.print("PB5:");
+    CONSOLE.println(String(g_pm5p0_ppd_value));
 
     /* Report PM10.0 PPD value */
-    Serial.print("PB10:");
-    Serial.println(String(g_pm10p0_ppd_value));
+    CONSOLE.print("PB10:");
+    CONSOLE.println(String(g_pm10p0_ppd_value));
   }
 }
 
@@ -402,7 +1192,7 @@ void reportToSerial()
 */
 void initOta()
 {
-  Serial.println("Initializing OTA...");
+  CONSOLE.println("Initializing OTA...");
 
   // Setup OTA
   ArduinoOTA.onStart([]() {
@@ -414,26 +1204,26 @@ void initOta()
     }
 
     // NOTE: if updating FS this would be the place to unmount FS using FS.end()
-    Serial.println("Start updating " + type);
+    CONSOLE.println("Start updating " + type);
   });
   ArduinoOTA.onEnd([]() {
-    Serial.println("\nEnd");
+    CONSOLE.println("\nEnd");
   });
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+    CONSOLE.printf("Progress: %u%%\r", (progress / (total / 100)));
   });
   ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("Error[%u]: ", error);
+    CONSOLE.printf("Error[%u]: ", error);
     if (error == OTA_AUTH_ERROR) {
-      Serial.println("Auth Failed");
+      CONSOLE.println("Auth Failed");
     } else if (error == OTA_BEGIN_ERROR) {
-      Serial.println("Begin Failed");
+      CONSOLE.println("Begin Failed");
     } else if (error == OTA_CONNECT_ERROR) {
-      Serial.println("Connect Failed");
+      CONSOLE.println("Connect Failed");
     } else if (error == OTA_RECEIVE_ERROR) {
-      Serial.println("Receive Failed");
+      CONSOLE.println("Receive Failed");
     } else if (error == OTA_END_ERROR) {
-      Serial.println("End Failed");
+      CONSOLE.println("End Failed");
     }
   });
   ArduinoOTA.begin();
@@ -445,14 +1235,101 @@ void initOta()
   ESPhttpUpdate.onError(update_error);
 }
 
+/*
+  Configure TLS for the API connection: certificate check, session resumption
+  and, if the server supports it, smaller buffers
+*/
+void initTls()
+{
+  CONSOLE.println("Initializing TLS...");
+
+  // Checking a pinned fingerprint is cheaper than validating the whole chain
+  if (strcmp(api_fingerprint, "") != 0 && client.setFingerprint(api_fingerprint)) {
+    CONSOLE.println("\tUsing pinned certificate fingerprint");
+  } else {
+    client.setInsecure();
+  }
+
+  // Reconnects resume the previous session instead of a full handshake
+  client.setSession(&tls_session);
+
+  // Shrink the 16 KB receive buffer if the server negotiates a smaller
+  // Maximum Fragment Length. Probe whichever server the reports go to, if
+  // they go over `client`, unless we already did before deep sleep: the
+  // probe costs a handshake of its own.
+  const char* report_url = useMqtt() ? mqtt_server : useCoap() ? coap_server : api_url;
+  char host[64];
+  uint16_t port;
+  if ((strncmp(report_url, "https://", 8) == 0 || strncmp(report_url, "mqtts://", 8) == 0)
+      && parseUrlHost(report_url, host, sizeof(host), port)) {
+    if (TLS_MFLN_UNKNOWN == g_tls_mfln) {
+      uint32_t start = millis();
+      bool supported = client.probeMaxFragmentLength(host, port, TLS_FRAGMENT_LENGTH);
+      g_tls_mfln = supported ? TLS_MFLN_SUPPORTED : TLS_MFLN_UNSUPPORTED;
+      CONSOLE.printf("\tMax Fragment Length %u %s by %s (probe took %u ms)\n",
+                     TLS_FRAGMENT_LENGTH, supported ? "supported" : "not supported", host, millis() - start);
+    } else {
+      CONSOLE.printf("\tMax Fragment Length %u %s by %s (as probed before deep sleep)\n",
+                     TLS_FRAGMENT_LENGTH, TLS_MFLN_SUPPORTED == g_tls_mfln ? "supported" : "not supported", host);
+    }
+    if (TLS_MFLN_SUPPORTED == g_tls_mfln) {
+      client.setBufferSizes(TLS_FRAGMENT_LENGTH, TLS_FRAGMENT_LENGTH);
+    }
+  }
+
+  CONSOLE.printf("\tFree heap: %u, largest block: %u\n", ESP.getFreeHeap(), ESP.getMaxFreeBlockSize());
+}
+
+/*
+  Extract host and port from an http(s), mqtt(s) or coap URL
+*/
+bool parseUrlHost(const char* url, char* host, size_t host_size, uint16_t& port)
+{
+  const char* start = strstr(url, "://");
+  start = start ? start + 3 : url;
+  if (strncmp(url, "http://", 7) == 0) {
+    port = 80;
+  } else if (strncmp(url, "mqtt://", 7) == 0) {
+    port = 1883;
+  } else if (strncmp(url, "mqtts://", 8) == 0) {
+    port = 8883;
+  } else if (strncmp(url, "coap://", 7) == 0) {
+    port = 5683;
+  } else {
+    port = 443;
+  }
+
+  size_t length = strcspn(start, ":/");
+  if (length == 0 || length >= host_size) {
+    return false;
+  }
+  memcpy(host, start, length);
+  host[length] = '\0';
+
+  if (start[length] == ':') {
+    port = atoi(start + length + 1);
+  }
+  return true;
+}
+
+/*
+  The path of a URL, e.g. "/api/v1/measurements", or "" if it has none
+*/
+const char* parseUrlPath(const char* url)
+{
+  const char* start = strstr(url, "://");
+  start = start ? start + 3 : url;
+  return start + strcspn(start, "/");
+}
+
 /*
   Configure Wifi and captive portal
 */
 void initWifi()
 {
-  Serial.println("Initializing WiFi...");
-  Serial.print("\tStored SSID: ");
-  Serial.println(WiFi.SSID());
+  CONSOLE.println("Initializing WiFi...");
+  CONSOLE.print("\tStored SSID: ");
+  CONSOLE.println(WiFi.SSID());
 
   // Disable debug for WiFi connect
   wc.setDebug(false);
@@ -488,6 +1365,14 @@ void initWifi()
   WiFiConnectParam description_param("description", "Description", description, 21);
   WiFiConnectParam api_url_param("api_url", "URL for the backend", api_url, 71);
   WiFiConnectParam ota_server_param("ota_server", "Server for OTA upgrades", ota_server, 71);
+  WiFiConnectParam batch_size_param("batch_size", "Readings per upload (up to 16)", batch_size, 4);
+  WiFiConnectParam batch_latency_param("batch_latency", "Max seconds a reading waits for upload", batch_latency, 7);
+  WiFiConnectParam api_format_param("api_format", "API format (json, cbor or columns)", api_format, 8);
+  WiFiConnectParam api_transport_param("api_transport", "Report over (http, mqtt or coap)", api_transport, 5);
+  WiFiConnectParam mqtt_server_param("mqtt_server", "MQTT broker, e.g. mqtts://host:8883", mqtt_server, 71);
+  WiFiConnectParam mqtt_topic_param("mqtt_topic", "MQTT topic", mqtt_topic, 41);
+  WiFiConnectParam coap_server_param("coap_server", "CoAP server, e.g. coap://host:5683/path (sends the API key unencrypted)", coap_server, 71);
+  WiFiConnectParam api_fingerprint_param("api_fingerprint", "SHA1 fingerprint of the backend certificate (optional)", api_fingerprint, 60);
   wc.addParameter(&api_key_param);
   wc.addParameter(&latitude_param);
   wc.addParameter(&longitude_param);
@@ -495,10 +1380,18 @@ void initWifi()
   wc.addParameter(&description_param);
   wc.addParameter(&api_url_param);
   wc.addParameter(&ota_server_param);
+  wc.addParameter(&api_fingerprint_param);
+  wc.addParameter(&batch_size_param);
+  wc.addParameter(&batch_latency_param);
+  wc.addParameter(&api_format_param);
+  wc.addParameter(&api_transport_param);
+  wc.addParameter(&mqtt_server_param);
+  wc.addParameter(&mqtt_topic_param);
+  wc.addParameter(&coap_server_param);
 
   // Check if we need to start captive portal
   if (!wc.autoConnect()) {
-      Serial.println("\tUnable to connect to wifi, starting Configuration portal and checking periodically for wifi");
+      CONSOLE.println("\tUnable to connect to wifi, starting Configuration portal and checking periodically for wifi");
       // When updating to newer SDK, need to make sure we can store the wifi configuration
       // https://github.com/esp8266/Arduino/pull/7902
       WiFi.persistent(true);
@@ -506,19 +1399,22 @@ void initWifi()
       WiFi.persistent(false);
   } else {
     if (force_params_portal) {
-      Serial.println("\tConfig params not found, start Params Portal");
+      CONSOLE.println("\tConfig params not found, start Params Portal");
       wc.startParamsPortal(AP_WAIT); //if not connected show the configuration portal
     }
   }
 
-  Serial.println("\tConnected to WiFi");
-  Serial.print("\tSSID: ");
-  Serial.println(WiFi.SSID());
-  Serial.print("\tIP address: ");
-  Serial.println(WiFi.localIP());
+  CONSOLE.println("\tConnected to WiFi");
+  CONSOLE.print("\tSSID: ");
+  CONSOLE.println(WiFi.SSID());
+  CONSOLE.print("\tIP address: ");
+  CONSOLE.println(WiFi.localIP());
 
   if (shouldSaveConfig) {
-    Serial.println("\tSaving configurations to filesystem");
+    CONSOLE.println("\tSaving configurations to filesystem");
+    strncpy(batch_size, batch_size_param.getValue(), sizeof(batch_size) - 1);
+    clampBatchSize();
+
     DynamicJsonBuffer jsonBuffer;
     JsonObject& json = jsonBuffer.createObject();
     json["api_key"] = api_key_param.getValue();
@@ -528,18 +1424,26 @@ void initWifi()
     json["description"] = description_param.getValue();
     json["api_url"] = api_url_param.getValue();
     json["ota_server"] = ota_server_param.getValue();
+    json["api_fingerprint"] = api_fingerprint_param.getValue();
+    json["batch_size"] = batch_size;
+    json["batch_latency"] = batch_latency_param.getValue();
+    json["api_format"] = api_format_param.getValue();
+    json["api_transport"] = api_transport_param.getValue();
+    json["mqtt_server"] = mqtt_server_param.getValue();
+    json["mqtt_topic"] = mqtt_topic_param.getValue();
+    json["coap_server"] = coap_server_param.getValue();
 
     File configFile = LittleFS.open("/config.json", "w");
     if (!configFile) {
-      Serial.println("\tFailed to open config file for writing");
+      CONSOLE.println("\tFailed to open config file for writing");
     } else {
       json.printTo(configFile);
       configFile.close();
     }
 
-    Serial.print('\t');
-    json.printTo(Serial);
-    Serial.println();
+    CONSOLE.print('\t');
+    json.printTo(CONSOLE);
+    CONSOLE.println();
 
     // Copy parameters to variables
     strcpy(api_key, json["api_key"]);
@@ -549,6 +1453,13 @@ void initWifi()
     strcpy(description, json["description"]);
     strcpy(api_url, json["api_url"]);
     strcpy(ota_server, json["ota_server"]);
+    strcpy(api_fingerprint, json["api_fingerprint"]);
+    strcpy(batch_latency, json["batch_latency"]);
+    strcpy(api_format, json["api_format"]);
+    strcpy(api_transport, json["api_transport"]);
+    strcpy(mqtt_server, json["mqtt_server"]);
+    strcpy(mqtt_topic, json["mqtt_topic"]);
+    strcpy(coap_server, json["coap_server"]);
   }
 }
 
@@ -558,16 +1469,20 @@ void initWifi()
 void initFS(void)
 {
   //read configuration from FS json
-  Serial.println("Mounting FS...");
+  CONSOLE.println("Mounting FS...");
 
   if (LittleFS.begin()) {
-    Serial.println("\tMounted file system");
+    CONSOLE.println("\tMounted file system");
+    g_measurement_log.begin();
+#ifdef PMS_CAPTURE_SIZE
+    pmsCapture.begin();
+#endif
     if (LittleFS.exists("/config.json")) {
       //file exists, reading and loading
-      Serial.println("\tReading config file");
+      CONSOLE.println("\tReading config file");
       File configFile = LittleFS.open("/config.json", "r");
       if (configFile) {
-        Serial.println("\tOpened config file");
+        CONSOLE.println("\tOpened config file");
         size_t size = configFile.size();
         // Allocate a buffer to store contents of the file.
         std::unique_ptr<char[]> buf(new char[size]);
@@ -590,40 +1505,81 @@ void initFS(void)
           if (json.containsKey("ota_server")) {
             strcpy(ota_server, json["ota_server"]);
           }
+          if (json.containsKey("api_fingerprint")) {
+            strcpy(api_fingerprint, json["api_fingerprint"]);
+          }
+          if (json.containsKey("batch_size")) {
+            strcpy(batch_size, json["batch_size"]);
+            clampBatchSize();
+          }
+          if (json.containsKey("batch_latency")) {
+            strcpy(batch_latency, json["batch_latency"]);
+          }
+          if (json.containsKey("api_format")) {
+            strcpy(api_format, json["api_format"]);
+          }
+          if (json.containsKey("api_transport")) {
+            strcpy(api_transport, json["api_transport"]);
+          }
+          if (json.containsKey("mqtt_server")) {
+            strcpy(mqtt_server, json["mqtt_server"]);
+          }
+          if (json.containsKey("mqtt_topic")) {
+            strcpy(mqtt_topic, json["mqtt_topic"]);
+          }
+          if (json.containsKey("coap_server")) {
+            strcpy(coap_server, json["coap_server"]);
+          }
           if (strcmp(api_key, "") == 0) {
-            Serial.println("\tStored parameters are empty, reset the parameters");
+            CONSOLE.println("\tStored parameters are empty, reset the parameters");
             force_params_portal = true;
           }
           else {
-            Serial.println("\tRead the following parameters:");
-            Serial.print("\t\tAPI URL: ");
-            Serial.println(api_url);
-            Serial.print("\t\tAPI-key: ");
-            Serial.println(api_key);
-            Serial.print("\t\tLatitude: ");
-            Serial.println(latitude);
-            Serial.print("\t\tLongitude: ");
-            Serial.println(longitude);
-            Serial.print("\t\tSensor: ");
-            Serial.println(sensor);
-            Serial.print("\t\tDescription: ");
-            Serial.println(description);
-            Serial.print("\t\tRemote OTA Server: ");
-            Serial.println(ota_server);
+            CONSOLE.println("\tRead the following parameters:");
+            CONSOLE.print("\t\tAPI URL: ");
+            CONSOLE.println(api_url);
+            CONSOLE.print("\t\tAPI-key: ");
+            CONSOLE.println(api_key);
+            CONSOLE.print("\t\tLatitude: ");
+            CONSOLE.println(latitude);
+            CONSOLE.print("\t\tLongitude: ");
+            CONSOLE.println(longitude);
+            CONSOLE.print("\t\tSensor: ");
+            CONSOLE.println(sensor);
+            CONSOLE.print("\t\tDescription: ");
+            CONSOLE.println(description);
+            CONSOLE.print("\t\tRemote OTA Server: ");
+            CONSOLE.println(ota_server);
+            CONSOLE.print("\t\tAPI fingerprint: ");
+            CONSOLE.println(api_fingerprint);
+            CONSOLE.print("\t\tBatch size: ");
+            CONSOLE.println(batch_size);
+            CONSOLE.print("\t\tBatch latency: ");
+            CONSOLE.println(batch_latency);
+            CONSOLE.print("\t\tAPI format: ");
+            CONSOLE.println(api_format);
+            CONSOLE.print("\t\tAPI transport: ");
+            CONSOLE.println(api_transport);
+            CONSOLE.print("\t\tMQTT server: ");
+            CONSOLE.println(mqtt_server);
+            CONSOLE.print("\t\tMQTT topic: ");
+            CONSOLE.println(mqtt_topic);
+            CONSOLE.print("\t\tCoAP server: ");
+            CONSOLE.println(coap_server);
           }
         } else {
-          Serial.println("\tFailed to load json config");
+          CONSOLE.println("\tFailed to load json config");
         }
         configFile.close();
       } else {
-        Serial.println("\tFailed to open config file");
+        CONSOLE.println("\tFailed to open config file");
       }
     } else {
-      Serial.println("\tConfig file wasn't found");
+      CONSOLE.println("\tConfig file wasn't found");
       force_params_portal = true;
     }
   } else {
-    Serial.println("\tFailed to mount FS");
+    CONSOLE.println("\tFailed to mount FS");
   }
 }
 
@@ -633,15 +1589,14 @@ void initFS(void)
 */
 void initNtp()
 {
-  Serial.println("Initializing NTP...");
+  CONSOLE.println("Initializing NTP...");
   configTime(0, 0, "pool.ntp.org", "time.nist.gov");
 
+  Timestamp timestamp;
   time(&now);
-  timeinfo = localtime(&now);
-  while (timeinfo->tm_year == 70) {
+  while (timestamp.breakdown(now).year == 1970) {
     delay(500);
     time(&now);
-    timeinfo = localtime(&now);
   }
 }
 
@@ -653,20 +1608,21 @@ void handleRemoteOta() {
 
   if (time_now - g_remote_ota_last_run > REMOTE_OTA_TIMEOUT || g_remote_ota_last_run == 0) {
     g_remote_ota_last_run = time_now;
-    Serial.println("Remote OTA: Checking for new available version");
-    t_httpUpdate_return ret = ESPhttpUpdate.update(client, ota_server, VERSION);
+    CONSOLE.println("Remote OTA: Checking for new available version");
+    client.stop();                  // Not enough heap for two TLS connections
+    t_httpUpdate_return ret = ESPhttpUpdate.update(ota_client, ota_server, VERSION);
 
     switch (ret) {
       case HTTP_UPDATE_FAILED:
-        Serial.printf("Remote OTA: failed, Error (%d): %s\n", ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());
+        CONSOLE.printf("Remote OTA: failed, Error (%d): %s\n", ESPhttpUpdate.getLastError(), ESPhttpUpdate.getLastErrorString().c_str());
         break;
 
       case HTTP_UPDATE_NO_UPDATES:
-        Serial.println("Remote OTA: No updates");
+        CONSOLE.println("Remote OTA: No updates");
         break;
 
       case HTTP_UPDATE_OK:
-        Serial.println("Remote OTA: Update OK");
+        CONSOLE.println("Remote OTA: Update OK");
         break;
     }
   }
@@ -682,7 +1638,7 @@ void check_reset()
   if ( digitalRead(ESP_FACTORY_RESET) == LOW) {
     delay(200);  // Wait 200ms and check if button is reset is still attempted
     if ( digitalRead(ESP_FACTORY_RESET) == LOW) {
-      Serial.println("Resetting sensor to factory defaults");
+      CONSOLE.println("Resetting sensor to factory defaults");
       LittleFS.format(); // Format Filesystem
       WiFi.persistent(true);
       WiFi.begin("0", "0"); // Hack to force wifi to be reset
@@ -0,0 +1,136 @@
+#ifndef BASELINE_PMS_H
+#define BASELINE_PMS_H
+
+// The parser as it was before the driver was reworked, for the benchmarks
+// to compare against: one byte per read() call, a virtual available() and
+// read() for each. Fake data and commands are left out.
+
+#include "Arduino.h"
+#include "PMS.h"
+
+class BaselinePMS
+{
+  public:
+    BaselinePMS(Stream& stream)
+    {
+      _stream = &stream;
+    }
+
+    bool read(PMS::DATA& data)
+    {
+      _data = &data;
+      loop();
+
+      return _status == STATUS_OK;
+    }
+
+  private:
+    enum STATUS { STATUS_WAITING, STATUS_OK };
+
+    uint8_t _payload[24];
+    Stream* _stream;
+    PMS::DATA* _data;
+    STATUS _status;
+
+    uint8_t _index = 0;
+    uint16_t _frameLen;
+    uint16_t _checksum;
+    uint16_t _calculatedChecksum;
+
+    void loop()
+    {
+      _status = STATUS_WAITING;
+      if (_stream->available())
+      {
+        uint8_t ch = _stream->read();
+
+        switch (_index)
+        {
+          case 0:
+            if (ch != 0x42)
+            {
+              return;
+            }
+            _calculatedChecksum = ch;
+            break;
+
+          case 1:
+            if (ch != 0x4D)
+            {
+              _index = 0;
+              return;
+            }
+            _calculatedChecksum += ch;
+            break;
+
+          case 2:
+            _calculatedChecksum += ch;
+            _frameLen = ch << 8;
+            break;
+
+          case 3:
+            _frameLen |= ch;
+            // Unsupported sensor, different frame length, transmission error e.t.c.
+            if (_frameLen != 2 * 9 + 2 && _frameLen != 2 * 13 + 2)
+            {
+              _index = 0;
+              return;
+            }
+            _calculatedChecksum += ch;
+            break;
+
+          default:
+            if (_index == _frameLen + 2)
+            {
+              _checksum = ch << 8;
+            }
+            else if (_index == _frameLen + 2 + 1)
+            {
+              _checksum |= ch;
+              if (_calculatedChecksum == _checksum)
+              {
+                _status = STATUS_OK;
+
+                // Standard Particles, CF=1.
+                _data->PM_SP_UG_1_0 = makeWord(_payload[0], _payload[1]);
+                _data->PM_SP_UG_2_5 = makeWord(_payload[2], _payload[3]);
+                _data->PM_SP_UG_10_0 = makeWord(_payload[4], _payload[5]);
+
+                // Atmospheric Environment.
+                _data->PM_AE_UG_1_0 = makeWord(_payload[6], _payload[7]);
+                _data->PM_AE_UG_2_5 = makeWord(_payload[8], _payload[9]);
+                _data->PM_AE_UG_10_0 = makeWord(_payload[10], _payload[11]);
+
+                // Total particles
+                _data->PM_TOTALPARTICLES_0_3 = makeWord(_payload[12], _payload[13]);
+                _data->PM_TOTALPARTICLES_0_5 = makeWord(_payload[14], _payload[15]);
+                _data->PM_TOTALPARTICLES_1_0 = makeWord(_payload[16], _payload[17]);
+                _data->PM_TOTALPARTICLES_2_5 = makeWord(_payload[18], _payload[19]);
+                _data->PM_TOTALPARTICLES_5_0 = makeWord(_payload[20], _payload[21]);
+                _data->PM_TOTALPARTICLES_10_0 = makeWord(_payload[22], _payload[23]);
+              }
+
+              _index = 0;
+              return;
+            }
+            else
+            {
+              _calculatedChecksum += ch;
+              uint8_t payloadIndex = _index - 4;
+
+              // Payload is common to all sensors (first 2x6 bytes).
+              if (payloadIndex < sizeof(_payload))
+              {
+                _payload[payloadIndex] = ch;
+              }
+            }
+
+            break;
+        }
+
+        _index++;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,56 @@
+// Time to render one reading: the sprintf() and localtime() formatting the
+// report used before, against MeasurementPayload's patched skeleton.
+//
+//   bench_payload [readings]
+
+#include <chrono>
+#include <time.h>
+#include "Arduino.h"
+#include "MeasurementPayload.h"
+
+static const char TEMPLATE[] =
+  "{\"sensor\": \"%s\",\"source\": \"%s\",\"version\": \"%s\",\"description\": \"%s\","
+  "\"pm1dot0\": %d,\"pm2dot5\": %d,\"pm10\": %d,\"longitude\": %s,\"latitude\": %s,"
+  "\"recorded\": \"%s\"}";
+
+int main(int argc, char** argv)
+{
+  uint32_t readings = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+  char output[512];
+  volatile size_t sink = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < readings; i++)
+  {
+    time_t recorded = 1700000000 + i;
+    struct tm* tm = localtime(&recorded);
+    char source[10];
+    char timestamp[80];
+    sprintf(source, "%x", 0xabc123);
+    sprintf(timestamp, "%d-%02d-%02dT%02d:%02d:%02d.000Z", tm->tm_year + 1900, tm->tm_mon + 1,
+            tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+    sink += sprintf(output, TEMPLATE, "PMS7003", source, "0.3.2", "Office",
+                    i & 1023, i & 511, i & 2047, "-57.5", "-25.3", timestamp);
+  }
+  auto middle = std::chrono::steady_clock::now();
+
+  MeasurementPayload payload;
+  payload.setDevice("PMS7003", "abc123", "0.3.2", "Office", "-57.5", "-25.3");
+  MeasurementQueue queue;
+  for (uint32_t i = 0; i < readings; i++)
+  {
+    queue.pop(1);
+    MeasurementQueue::MEASUREMENT measurement = {
+      1700000000 + i, (uint16_t)(i & 1023), (uint16_t)(i & 511), (uint16_t)(i & 2047)
+    };
+    queue.push(measurement);
+    payload.begin(queue, 1);
+    sink += payload.read((uint8_t*)output, sizeof(output));
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  printf("sprintf %.0f ns, skeleton %.0f ns per reading\n",
+         std::chrono::duration<double, std::nano>(middle - start).count() / readings,
+         std::chrono::duration<double, std::nano>(end - middle).count() / readings);
+  return sink > 0 ? 0 : 1;
+}
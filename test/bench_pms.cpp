@@ -0,0 +1,191 @@
+// Parser throughput on synthetic input: frames/sec and ns per input byte
+// for clean, noisy, truncated and misaligned streams, through read() with
+// bulk and single byte availability, readUntil() and feed(), against the
+// parser the driver started from. A second table compares the stream
+// variants on identical input and chunking: read() through the virtual
+// Stream against feed() straight from the buffer.
+//
+//   bench_pms [frames]
+
+#include <chrono>
+#include "Arduino.h"
+#include "PMS.h"
+#include "baseline_pms.h"
+#include "support.h"
+
+enum DATASET { CLEAN, NOISY, TRUNCATED, MISALIGNED };
+static const char* DATASET_NAMES[] = { "clean", "noisy", "truncated", "misaligned" };
+
+enum PATH { BASELINE, READ_BULK, READ_BYTE, READ_UNTIL, FEED };
+static const char* PATH_NAMES[] = { "baseline", "read()", "read() 1 byte", "readUntil()", "feed()" };
+
+static std::vector<uint8_t> generate(DATASET dataset, uint32_t frames)
+{
+  std::vector<uint8_t> bytes;
+  bytes.reserve(frames * 40);
+  uint32_t state = 1;
+  for (uint32_t i = 0; i < frames; i++)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+
+    if (dataset == MISALIGNED && i == 0)
+    {
+      // Joining the line halfway through a frame
+      std::vector<uint8_t> partial;
+      appendFrame(partial, (uint16_t)1000);
+      bytes.insert(bytes.end(), partial.begin() + 13, partial.end());
+    }
+    appendFrame(bytes, (uint16_t)i);
+
+    if (dataset == NOISY && state % 4 == 0)
+    {
+      // Line noise, sometimes looking like a start of frame
+      uint8_t noise[] = { (uint8_t)state, 0x42, (uint8_t)(state >> 8), 0x4D, 0x42 };
+      bytes.insert(bytes.end(), noise, noise + 1 + (state >> 16) % 5);
+    }
+    else if (dataset == TRUNCATED && state % 8 == 0)
+    {
+      bytes.resize(bytes.size() - 1 - (state >> 16) % 24);
+    }
+  }
+  return bytes;
+}
+
+static uint32_t run(PATH path, const std::vector<uint8_t>& bytes)
+{
+  MemoryStream stream;
+  stream.input = bytes;
+  stream.chunk = path == READ_BYTE ? 1 : 64;
+  PMS pms(stream);
+  PMS::DATA data;
+  uint32_t frames = 0;
+
+  switch (path)
+  {
+    case BASELINE:
+    {
+      BaselinePMS baseline(stream);
+      while (stream.position < bytes.size())
+      {
+        frames += baseline.read(data);
+      }
+      break;
+    }
+
+    case READ_BULK:
+    case READ_BYTE:
+      while (stream.position < bytes.size())
+      {
+        frames += pms.read(data);
+      }
+      break;
+
+    case READ_UNTIL:
+      // Gives up after 10 ms once the input has run out
+      while (pms.readUntil(data, 10))
+      {
+        frames++;
+      }
+      break;
+
+    case FEED:
+      for (size_t offset = 0, consumed; offset < bytes.size(); offset += consumed)
+      {
+        frames += pms.feed(bytes.data() + offset, min((size_t)64, bytes.size() - offset), consumed);
+      }
+      break;
+  }
+
+  return frames;
+}
+
+// Clean input handed over in chunks of the given size, either through a
+// Stream or directly
+static double variant(bool stream, const std::vector<uint8_t>& bytes, size_t chunk, uint32_t& frames)
+{
+  MemoryStream memory;
+  memory.input = bytes;
+  memory.chunk = chunk;
+  PMS pms(memory);
+  PMS::DATA data;
+  frames = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  if (stream)
+  {
+    while (memory.position < bytes.size())
+    {
+      frames += pms.read(data);
+    }
+  }
+  else
+  {
+    for (size_t offset = 0, consumed; offset < bytes.size(); offset += consumed)
+    {
+      frames += pms.feed(bytes.data() + offset, min(chunk, bytes.size() - offset), consumed);
+    }
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t frames = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  int failures = 0;
+
+  printf("%-11s %-14s %10s %12s %8s %8s\n", "input", "path", "frames", "frames/s", "ns/byte", "speedup");
+  for (DATASET dataset : { CLEAN, NOISY, TRUNCATED, MISALIGNED })
+  {
+    std::vector<uint8_t> bytes = generate(dataset, frames);
+    double baseline = 0;
+    for (PATH path : { BASELINE, READ_BULK, READ_BYTE, READ_UNTIL, FEED })
+    {
+      auto start = std::chrono::steady_clock::now();
+      uint32_t accepted = run(path, bytes);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (path == READ_UNTIL)
+      {
+        seconds -= 0.010;
+      }
+
+      if (path == BASELINE)
+      {
+        baseline = seconds;
+      }
+
+      printf("%-11s %-14s %10u %12.0f %8.2f %7.2fx\n", DATASET_NAMES[dataset], PATH_NAMES[path],
+             accepted, accepted / seconds, seconds * 1e9 / bytes.size(), baseline / seconds);
+
+      // Every intact frame must come through
+      if ((dataset == CLEAN || dataset == MISALIGNED) && accepted != frames)
+      {
+        printf("expected %u frames\n", frames);
+        failures++;
+      }
+    }
+  }
+
+  printf("\n%-6s %-14s %10s %12s %8s %8s\n", "chunk", "variant", "frames", "frames/s", "ns/byte", "speedup");
+  std::vector<uint8_t> bytes = generate(CLEAN, frames);
+  for (size_t chunk : { 1, 8, 32, 64 })
+  {
+    uint32_t streamFrames, feedFrames;
+    double streamSeconds = variant(true, bytes, chunk, streamFrames);
+    double feedSeconds = variant(false, bytes, chunk, feedFrames);
+
+    printf("%-6zu %-14s %10u %12.0f %8.2f %7.2fx\n", chunk, "Stream read()",
+           streamFrames, streamFrames / streamSeconds, streamSeconds * 1e9 / bytes.size(), 1.0);
+    printf("%-6zu %-14s %10u %12.0f %8.2f %7.2fx\n", chunk, "feed()",
+           feedFrames, feedFrames / feedSeconds, feedSeconds * 1e9 / bytes.size(), streamSeconds / feedSeconds);
+
+    if (streamFrames != frames || feedFrames != frames)
+    {
+      printf("expected %u frames\n", frames);
+      failures++;
+    }
+  }
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+#include "Arduino.h"
+#include <chrono>
+
+static const std::chrono::steady_clock::time_point START = std::chrono::steady_clock::now();
+static uint64_t skipped = 0;      // Microseconds added by delay()
+
+static uint64_t now()
+{
+  auto elapsed = std::chrono::steady_clock::now() - START;
+  return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + skipped;
+}
+
+unsigned long millis()
+{
+  return (uint32_t)(now() / 1000);
+}
+
+unsigned long micros()
+{
+  return (uint32_t)now();
+}
+
+void delay(unsigned long ms)
+{
+  skipped += (uint64_t)ms * 1000;
+}
+
+void yield()
+{
+}
+
+long random(long howbig)
+{
+  return howbig > 0 ? rand() % howbig : 0;
+}
+
+long random(long howsmall, long howbig)
+{
+  return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
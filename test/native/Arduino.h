@@ -0,0 +1,61 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Stand-in for the parts of the ESP8266 Arduino core the firmware's classes
+// use, so they build and run on a workstation. Time comes from the host's
+// steady clock; delay() doesn't sleep but moves the clock forward, so tests
+// can step through timeouts instantly.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include "Stream.h"
+
+using std::min;
+using std::max;
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+inline uint16_t makeWord(uint8_t high, uint8_t low)
+{
+  return (high << 8) | low;
+}
+
+inline void* memcpy_P(void* destination, const void* source, size_t length)
+{
+  return memcpy(destination, source, length);
+}
+
+inline uint8_t pgm_read_byte(const void* address)
+{
+  return *(const uint8_t*)address;
+}
+
+inline uint16_t pgm_read_word(const void* address)
+{
+  return *(const uint16_t*)address;
+}
+
+inline uint32_t pgm_read_dword(const void* address)
+{
+  return *(const uint32_t*)address;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef NATIVE_CLIENT_H
+#define NATIVE_CLIENT_H
+
+#include "Udp.h"
+
+// The Arduino TCP client interface; tests implement it with a fake server.
+class Client : public Stream
+{
+  public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char* host, uint16_t port) = 0;
+    virtual uint8_t connected() = 0;
+    virtual void stop() = 0;
+
+    using Print::write;
+    using Stream::read;
+};
+
+#endif
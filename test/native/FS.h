@@ -0,0 +1,219 @@
+#ifndef NATIVE_FS_H
+#define NATIVE_FS_H
+
+// In-memory stand-in for the ESP8266 file system API (FS, File, Dir), enough
+// for LittleFS users to run against. Files live as long as their FS.
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "Stream.h"
+
+class String : public std::string
+{
+  public:
+    String(const std::string& text) : std::string(text) {}
+};
+
+class File : public Stream
+{
+  public:
+    File() {}
+    File(std::shared_ptr<std::vector<uint8_t>> data, size_t position) : _data(data), _position(position) {}
+
+    explicit operator bool() const
+    {
+      return _data != nullptr;
+    }
+
+    int available() override
+    {
+      return _data ? _data->size() - _position : 0;
+    }
+
+    int read() override
+    {
+      return available() > 0 ? (*_data)[_position++] : -1;
+    }
+
+    int peek() override
+    {
+      return available() > 0 ? (*_data)[_position] : -1;
+    }
+
+    int read(uint8_t* buffer, size_t length) override
+    {
+      size_t count = std::min(length, (size_t)available());
+      if (count > 0)
+      {
+        memcpy(buffer, _data->data() + _position, count);
+        _position += count;
+      }
+      return count;
+    }
+
+    size_t readBytes(char* buffer, size_t length) override
+    {
+      return read((uint8_t*)buffer, length);
+    }
+
+    size_t write(uint8_t ch) override
+    {
+      return write(&ch, 1);
+    }
+
+    size_t write(const uint8_t* buffer, size_t length) override
+    {
+      if (!_data)
+      {
+        return 0;
+      }
+      if (_data->size() < _position + length)
+      {
+        _data->resize(_position + length);
+      }
+      memcpy(_data->data() + _position, buffer, length);
+      _position += length;
+      return length;
+    }
+
+    bool seek(uint32_t position)
+    {
+      if (!_data || position > _data->size())
+      {
+        return false;
+      }
+      _position = position;
+      return true;
+    }
+
+    bool truncate(uint32_t size)
+    {
+      if (!_data)
+      {
+        return false;
+      }
+      _data->resize(size);
+      _position = std::min(_position, (size_t)size);
+      return true;
+    }
+
+    size_t position()
+    {
+      return _position;
+    }
+
+    size_t size()
+    {
+      return _data ? _data->size() : 0;
+    }
+
+    void close()
+    {
+      _data = nullptr;
+    }
+
+  private:
+    std::shared_ptr<std::vector<uint8_t>> _data;
+    size_t _position = 0;
+};
+
+class Dir
+{
+  public:
+    void add(const std::string& name, size_t size)
+    {
+      _entries.push_back(std::make_pair(name, size));
+    }
+
+    bool next()
+    {
+      return ++_index < (int)_entries.size();
+    }
+
+    String fileName()
+    {
+      return String(_entries[_index].first);
+    }
+
+    size_t fileSize()
+    {
+      return _entries[_index].second;
+    }
+
+  private:
+    std::vector<std::pair<std::string, size_t>> _entries;
+    int _index = -1;
+};
+
+class FS
+{
+  public:
+    // Modes "r", "r+", "w" and "a"
+    File open(const char* path, const char* mode)
+    {
+      auto found = _files.find(path);
+      if (mode[0] == 'r')
+      {
+        return found == _files.end() ? File() : File(found->second, 0);
+      }
+
+      if (found == _files.end() || mode[0] == 'w')
+      {
+        _files[path] = std::make_shared<std::vector<uint8_t>>();
+      }
+      std::shared_ptr<std::vector<uint8_t>> data = _files[path];
+      return File(data, mode[0] == 'a' ? data->size() : 0);
+    }
+
+    bool exists(const char* path)
+    {
+      return _files.count(path) > 0 || _dirs.count(path) > 0;
+    }
+
+    bool remove(const char* path)
+    {
+      return _files.erase(path) > 0;
+    }
+
+    bool rename(const char* from, const char* to)
+    {
+      auto found = _files.find(from);
+      if (found == _files.end())
+      {
+        return false;
+      }
+      _files[to] = found->second;
+      _files.erase(found);
+      return true;
+    }
+
+    bool mkdir(const char* path)
+    {
+      return _dirs.insert(path).second;
+    }
+
+    // Files directly inside `path`
+    Dir openDir(const char* path)
+    {
+      std::string prefix = std::string(path) + "/";
+      Dir dir;
+      for (auto& file : _files)
+      {
+        if (file.first.compare(0, prefix.size(), prefix) == 0
+            && file.first.find('/', prefix.size()) == std::string::npos)
+        {
+          dir.add(file.first.substr(prefix.size()), file.second->size());
+        }
+      }
+      return dir;
+    }
+
+  private:
+    std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> _files;
+    std::set<std::string> _dirs;
+};
+
+#endif
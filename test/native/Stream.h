@@ -0,0 +1,84 @@
+#ifndef NATIVE_STREAM_H
+#define NATIVE_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Print and Stream as declared by the ESP8266 Arduino core 3.x, without the
+// formatting helpers.
+class Print
+{
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t ch) = 0;
+
+    virtual size_t write(const uint8_t* buffer, size_t length)
+    {
+      size_t written = 0;
+      while (length-- > 0 && write(*buffer++) == 1)
+      {
+        written++;
+      }
+      return written;
+    }
+
+    size_t write(const char* text)
+    {
+      return write((const uint8_t*)text, strlen(text));
+    }
+
+    size_t write(const char* buffer, size_t length)
+    {
+      return write((const uint8_t*)buffer, length);
+    }
+
+    virtual int availableForWrite()
+    {
+      return 0;
+    }
+
+    virtual void flush()
+    {
+    }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    virtual int read(uint8_t* buffer, size_t length)
+    {
+      return readBytes((char*)buffer, length);
+    }
+
+    virtual size_t readBytes(char* buffer, size_t length)
+    {
+      size_t count = 0;
+      while (count < length)
+      {
+        int ch = read();
+        if (ch < 0)
+        {
+          break;
+        }
+        buffer[count++] = ch;
+      }
+      return count;
+    }
+
+    size_t readBytes(uint8_t* buffer, size_t length)
+    {
+      return readBytes((char*)buffer, length);
+    }
+
+    void setTimeout(unsigned long /* timeout */)
+    {
+    }
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef NATIVE_UDP_H
+#define NATIVE_UDP_H
+
+#include "Stream.h"
+
+struct IPAddress
+{
+  uint32_t address = 0;
+};
+
+// The Arduino UDP interface; tests implement it with a fake network.
+class UDP : public Stream
+{
+  public:
+    virtual uint8_t begin(uint16_t port) = 0;
+    virtual void stop() = 0;
+
+    virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+    virtual int beginPacket(const char* host, uint16_t port) = 0;
+    virtual int endPacket() = 0;
+    virtual int parsePacket() = 0;
+
+    virtual IPAddress remoteIP() = 0;
+    virtual uint16_t remotePort() = 0;
+
+    using Print::write;
+    using Stream::read;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef NATIVE_COREDECLS_H
+#define NATIVE_COREDECLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The core's CRC-32: polynomial 0x04C11DB7, most significant bit first
+inline uint32_t crc32(const void* data, size_t length, uint32_t crc = 0xffffffff)
+{
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (length-- > 0)
+  {
+    uint8_t ch = *bytes++;
+    for (uint32_t i = 0x80; i > 0; i >>= 1)
+    {
+      bool bit = crc & 0x80000000;
+      if (ch & i)
+      {
+        bit = !bit;
+      }
+      crc <<= 1;
+      if (bit)
+      {
+        crc ^= 0x04c11db7;
+      }
+    }
+  }
+  return crc;
+}
+
+#endif
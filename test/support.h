@@ -0,0 +1,104 @@
+#ifndef SUPPORT_H
+#define SUPPORT_H
+
+// Helpers shared by the host tests and benchmarks: synthetic PMS frames and
+// a Stream over a byte buffer.
+
+#include <vector>
+#include "Arduino.h"
+#include "PMS.h"
+
+// Append a frame carrying `values` (the 13 data words, version last), with
+// a valid checksum unless `corrupt`
+inline void appendFrame(std::vector<uint8_t>& bytes, const uint16_t* values, bool corrupt = false)
+{
+  uint8_t frame[32] = { 0x42, 0x4D, 0x00, 28 };
+  for (uint8_t i = 0; i < 13; i++)
+  {
+    frame[4 + 2 * i] = values[i] >> 8;
+    frame[5 + 2 * i] = values[i] & 0xFF;
+  }
+
+  uint16_t checksum = 0;
+  for (uint8_t i = 0; i < 30; i++)
+  {
+    checksum += frame[i];
+  }
+  if (corrupt)
+  {
+    checksum++;
+  }
+  frame[30] = checksum >> 8;
+  frame[31] = checksum & 0xFF;
+  bytes.insert(bytes.end(), frame, frame + sizeof(frame));
+}
+
+// A frame whose values are all derived from `seed`
+inline void appendFrame(std::vector<uint8_t>& bytes, uint16_t seed, bool corrupt = false)
+{
+  uint16_t values[13];
+  for (uint8_t i = 0; i < 12; i++)
+  {
+    values[i] = seed + i;
+  }
+  values[12] = 0;
+  appendFrame(bytes, values, corrupt);
+}
+
+// Stream reading from `input`, at most `chunk` bytes reported available at a
+// time. Written bytes are kept in `output`. With `loop` set the input starts
+// over once it has all been read.
+class MemoryStream : public Stream
+{
+  public:
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+    size_t position = 0;
+    size_t chunk = SIZE_MAX;
+    bool loop = false;
+
+    int available() override
+    {
+      if (position == input.size() && loop)
+      {
+        position = 0;
+      }
+      return min(input.size() - position, chunk);
+    }
+
+    int read() override
+    {
+      return available() > 0 ? input[position++] : -1;
+    }
+
+    int peek() override
+    {
+      return available() > 0 ? input[position] : -1;
+    }
+
+    int read(uint8_t* buffer, size_t length) override
+    {
+      size_t count = min(length, (size_t)available());
+      memcpy(buffer, input.data() + position, count);
+      position += count;
+      return count;
+    }
+
+    size_t readBytes(char* buffer, size_t length) override
+    {
+      return read((uint8_t*)buffer, length);
+    }
+
+    size_t write(uint8_t ch) override
+    {
+      output.push_back(ch);
+      return 1;
+    }
+
+    int availableForWrite() override
+    {
+      return 64;
+    }
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TEST_H
+#define TEST_H
+
+// Minimal checks for the host tests. Failures are printed and counted, and
+// testResult() becomes the exit status ctest looks at.
+
+#include <stdio.h>
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      g_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do { \
+    long long expected_ = (expected); \
+    long long actual_ = (actual); \
+    if (expected_ != actual_) { \
+      printf("%s:%d: CHECK_EQUAL(%s, %s) failed: %lld != %lld\n", \
+             __FILE__, __LINE__, #expected, #actual, expected_, actual_); \
+      g_failures++; \
+    } \
+  } while (0)
+
+#define RUN(test) \
+  do { \
+    printf("%s\n", #test); \
+    test(); \
+  } while (0)
+
+inline int testResult()
+{
+  if (g_failures > 0)
+  {
+    printf("%d checks failed\n", g_failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#include "Arduino.h"
+#include "PMSAggregate.h"
+#include "test.h"
+
+static void testSummary()
+{
+  PMSAggregate aggregate;
+  const uint16_t values[] = { 5, 1, 9, 3, 100, 4, 2, 6 };
+  for (uint16_t value : values)
+  {
+    PMS::DATA data = {};
+    data.PM_SP_UG_2_5 = value;
+    data.PM_TOTALPARTICLES_10_0 = 2 * value;
+    CHECK(aggregate.add(data));
+  }
+  CHECK_EQUAL(8, aggregate.count());
+
+  PMSAggregate::RESULT result;
+  CHECK(aggregate.summarize(result));
+  CHECK_EQUAL(1, result.min.PM_SP_UG_2_5);
+  CHECK_EQUAL(100, result.max.PM_SP_UG_2_5);
+  CHECK_EQUAL(5, result.median.PM_SP_UG_2_5);           // 4.5 rounded
+  CHECK_EQUAL(5, result.mean.PM_SP_UG_2_5);             // 3, 4, 5 and 6
+  CHECK_EQUAL(200, result.max.PM_TOTALPARTICLES_10_0);
+  CHECK_EQUAL(0, result.median.PM_SP_UG_1_0);
+}
+
+static void testLimits()
+{
+  PMSAggregate aggregate;
+  PMSAggregate::RESULT result;
+  CHECK(!aggregate.summarize(result));
+
+  PMS::DATA data = {};
+  for (uint8_t i = 0; i < PMSAggregate::MAX_SAMPLES; i++)
+  {
+    CHECK(aggregate.add(data));
+  }
+  CHECK(!aggregate.add(data));
+
+  aggregate.reset();
+  CHECK_EQUAL(0, aggregate.count());
+}
+
+int main()
+{
+  RUN(testSummary);
+  RUN(testLimits);
+  return testResult();
+}
@@ -0,0 +1,210 @@
+#include "Arduino.h"
+#include "PMSCapture.h"
+#include "support.h"
+#include "test.h"
+
+static void appendFrames(PMSCapture& capture, uint16_t first, uint16_t count)
+{
+  for (uint16_t i = first; i < first + count; i++)
+  {
+    std::vector<uint8_t> frame;
+    appendFrame(frame, i, i % 5 == 4);
+    capture.append(frame.data(), frame.size(), i % 5 != 4);
+  }
+}
+
+static uint32_t fileSize(FS& fs, const char* path)
+{
+  File file = fs.open(path, "r");
+  uint32_t size = file.size();
+  file.close();
+  return size;
+}
+
+// Replaying a capture gives the decisions made when it was recorded
+static void testReplay()
+{
+  FS fs;
+  PMSCapture capture(fs, "/pms.cap", 65536);
+  capture.begin();
+  appendFrames(capture, 0, 20);
+
+  // Whole pages only until flushed
+  CHECK_EQUAL(3 * PageBuffer::PAGE_SIZE, fileSize(fs, "/pms.cap"));
+  capture.flush();
+  CHECK_EQUAL(20 * sizeof(PMSCapture::RECORD), fileSize(fs, "/pms.cap"));
+
+  MemoryStream stream;
+  PMS pms(stream);
+  File file = fs.open("/pms.cap", "r");
+  uint32_t mismatches;
+  CHECK_EQUAL(20, PMSCapture::replay(file, pms, mismatches));
+  CHECK_EQUAL(0, mismatches);
+  CHECK_EQUAL(16, pms.stats().framesAccepted);
+  CHECK_EQUAL(4, pms.stats().checksumErrors);
+  file.close();
+
+  // A frame recorded as rejected that now parses is reported
+  PMSCapture::RECORD record = {};
+  std::vector<uint8_t> frame;
+  appendFrame(frame, 99);
+  record.marker = PMSCapture::MARKER;
+  record.length = frame.size();
+  memcpy(record.frame, frame.data(), frame.size());
+  stream.input.assign((uint8_t*)&record, (uint8_t*)&record + sizeof(record));
+  CHECK_EQUAL(1, PMSCapture::replay(stream, pms, mismatches));
+  CHECK_EQUAL(1, mismatches);
+}
+
+// After a reboot writes continue on the page boundaries of the existing file
+static void testReboot()
+{
+  FS fs;
+  {
+    PMSCapture capture(fs, "/pms.cap", 65536);
+    capture.begin();
+    appendFrames(capture, 0, 3);
+    capture.flush();
+  }
+  CHECK_EQUAL(3 * sizeof(PMSCapture::RECORD), fileSize(fs, "/pms.cap"));
+
+  PMSCapture capture(fs, "/pms.cap", 65536);
+  capture.begin();
+  appendFrames(capture, 3, 3);
+  CHECK_EQUAL(PageBuffer::PAGE_SIZE, fileSize(fs, "/pms.cap"));
+}
+
+// A reset without flush() leaves part of a record, which is cut off
+static void testPartialRecord()
+{
+  FS fs;
+  {
+    PMSCapture capture(fs, "/pms.cap", 65536);
+    capture.begin();
+    appendFrames(capture, 0, 7);
+  }
+  CHECK_EQUAL(PageBuffer::PAGE_SIZE, fileSize(fs, "/pms.cap"));
+
+  PMSCapture capture(fs, "/pms.cap", 65536);
+  capture.begin();
+  uint32_t records = PageBuffer::PAGE_SIZE / sizeof(PMSCapture::RECORD);
+  CHECK_EQUAL(records * sizeof(PMSCapture::RECORD), fileSize(fs, "/pms.cap"));
+  appendFrames(capture, 7, 1);
+  capture.flush();
+
+  MemoryStream stream;
+  PMS pms(stream);
+  File file = fs.open("/pms.cap", "r");
+  uint32_t mismatches;
+  CHECK_EQUAL(records + 1, PMSCapture::replay(file, pms, mismatches));
+  CHECK_EQUAL(0, mismatches);
+}
+
+// Files are rotated between records: both replay in full, frame for frame
+static void testRotation()
+{
+  FS fs;
+  PMSCapture capture(fs, "/pms.cap", 1024);
+  capture.begin();
+  appendFrames(capture, 0, 60);
+  capture.flush();
+
+  // 23 records fit in 1024 bytes: frames 23 to 45 in the old file, 46 to 59
+  // in the current one
+  uint32_t perFile = 1024 / sizeof(PMSCapture::RECORD);
+  CHECK_EQUAL(perFile * sizeof(PMSCapture::RECORD), fileSize(fs, "/pms.cap.1"));
+  CHECK_EQUAL((60 - 2 * perFile) * sizeof(PMSCapture::RECORD), fileSize(fs, "/pms.cap"));
+  CHECK_EQUAL(0, capture.dropped());
+
+  MemoryStream stream;
+  PMS pms(stream);
+  uint16_t next = perFile;
+  uint32_t replayed = 0;
+  for (const char* path : { "/pms.cap.1", "/pms.cap" })
+  {
+    File file = fs.open(path, "r");
+    PMSCapture::RECORD record;
+    while (PMSCapture::readRecord(file, record))
+    {
+      std::vector<uint8_t> frame;
+      appendFrame(frame, next, next % 5 == 4);
+      CHECK_EQUAL(frame.size(), record.length);
+      CHECK(memcmp(frame.data(), record.frame, frame.size()) == 0);
+      CHECK_EQUAL(next % 5 != 4, record.valid);
+      next++;
+    }
+    file.close();
+
+    uint32_t mismatches;
+    file = fs.open(path, "r");
+    replayed += PMSCapture::replay(file, pms, mismatches);
+    CHECK_EQUAL(0, mismatches);
+    file.close();
+  }
+  CHECK_EQUAL(60, next);
+  CHECK_EQUAL(60 - perFile, replayed);
+
+  // Frames 4, 9, ... were recorded corrupt
+  CHECK_EQUAL(60 - perFile - 8, pms.stats().framesAccepted);
+}
+
+// Bytes between records, e.g. left by a write that failed halfway, are
+// skipped
+static void testResync()
+{
+  FS fs;
+  PMSCapture capture(fs, "/pms.cap", 65536);
+  capture.begin();
+  appendFrames(capture, 0, 3);
+  capture.flush();
+
+  File file = fs.open("/pms.cap", "r");
+  std::vector<uint8_t> bytes(fileSize(fs, "/pms.cap"));
+  file.read(bytes.data(), bytes.size());
+  file.close();
+
+  // Garbage in front, and the second record cut short
+  MemoryStream stream;
+  uint8_t garbage[] = { 0x97, 0xCA, 0x42, 0x4D, 0x00 };
+  stream.input.assign(garbage, garbage + sizeof(garbage));
+  stream.input.insert(stream.input.end(), bytes.begin(), bytes.begin() + sizeof(PMSCapture::RECORD));
+  stream.input.insert(stream.input.end(), bytes.begin() + sizeof(PMSCapture::RECORD),
+                      bytes.begin() + sizeof(PMSCapture::RECORD) + 20);
+  stream.input.insert(stream.input.end(), bytes.begin() + 2 * sizeof(PMSCapture::RECORD), bytes.end());
+
+  MemoryStream serial;
+  PMS pms(serial);
+  uint32_t mismatches;
+  CHECK_EQUAL(2, PMSCapture::replay(stream, pms, mismatches));
+  CHECK_EQUAL(0, mismatches);
+  CHECK_EQUAL(2, pms.stats().framesAccepted);
+}
+
+// A file that doesn't start with a record is set aside rather than added to
+static void testMisalignedFile()
+{
+  FS fs;
+  File file = fs.open("/pms.cap", "w");
+  uint8_t tail[50] = {};
+  file.write(tail, sizeof(tail));
+  file.close();
+
+  PMSCapture capture(fs, "/pms.cap", 65536);
+  capture.begin();
+  appendFrames(capture, 0, 1);
+  capture.flush();
+
+  CHECK_EQUAL(sizeof(tail), fileSize(fs, "/pms.cap.1"));
+  CHECK_EQUAL(sizeof(PMSCapture::RECORD), fileSize(fs, "/pms.cap"));
+}
+
+int main()
+{
+  RUN(testReplay);
+  RUN(testReboot);
+  RUN(testPartialRecord);
+  RUN(testRotation);
+  RUN(testResync);
+  RUN(testMisalignedFile);
+  return testResult();
+}
@@ -0,0 +1,227 @@
+#include <deque>
+#include <vector>
+#include "Arduino.h"
+#include "CoapClient.h"
+#include "test.h"
+
+// A network that records every datagram sent and hands out scripted
+// responses, each once `afterSends` datagrams have gone out
+class FakeUdp : public UDP
+{
+  public:
+    struct RESPONSE
+    {
+      size_t afterSends;
+      std::vector<uint8_t> bytes;
+    };
+
+    std::vector<std::vector<uint8_t>> sent;
+    std::deque<RESPONSE> inbox;
+
+    uint8_t begin(uint16_t /* port */) override { return 1; }
+    void stop() override {}
+
+    int beginPacket(IPAddress /* ip */, uint16_t /* port */) override
+    {
+      _packet.clear();
+      return 1;
+    }
+
+    int beginPacket(const char* /* host */, uint16_t /* port */) override
+    {
+      _packet.clear();
+      return 1;
+    }
+
+    int endPacket() override
+    {
+      sent.push_back(_packet);
+      return 1;
+    }
+
+    int parsePacket() override
+    {
+      if (inbox.empty() || inbox.front().afterSends > sent.size())
+      {
+        _received.clear();
+        return 0;
+      }
+      _received = inbox.front().bytes;
+      _position = 0;
+      inbox.pop_front();
+      return _received.size();
+    }
+
+    IPAddress remoteIP() override { return IPAddress(); }
+    uint16_t remotePort() override { return 5683; }
+
+    size_t write(uint8_t ch) override
+    {
+      _packet.push_back(ch);
+      return 1;
+    }
+
+    int available() override { return _received.size() - _position; }
+    int read() override { return available() > 0 ? _received[_position++] : -1; }
+    int peek() override { return available() > 0 ? _received[_position] : -1; }
+
+    int read(uint8_t* buffer, size_t length) override
+    {
+      size_t count = min(length, (size_t)available());
+      memcpy(buffer, _received.data() + _position, count);
+      _position += count;
+      return count;
+    }
+
+  private:
+    std::vector<uint8_t> _packet;
+    std::vector<uint8_t> _received;
+    size_t _position = 0;
+};
+
+enum { TYPE_CON, TYPE_NON, TYPE_ACK, TYPE_RST };
+
+// A response of `type` and `code` to message `id`, carrying the token of
+// the request `request` unless `token` is false
+static std::vector<uint8_t> response(uint8_t type, uint8_t code, uint16_t id,
+                                     const std::vector<uint8_t>& request, bool token = true)
+{
+  std::vector<uint8_t> bytes = {
+    (uint8_t)(0x40 | (type << 4) | (token ? 4 : 0)), code, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF)
+  };
+  if (token)
+  {
+    bytes.insert(bytes.end(), request.begin() + 4, request.begin() + 8);
+  }
+  return bytes;
+}
+
+
+struct Fixture
+{
+  MeasurementQueue queue;
+  MeasurementPayload payload;
+  FakeUdp udp;
+  CoapClient coap;
+
+  Fixture() : coap(udp)
+  {
+    payload.setDevice("PMS7003", "abc123", "0.3.2", "Desc", "-57.5", "-25.3");
+    MeasurementQueue::MEASUREMENT measurement = { 1700000000, 1, 2, 3 };
+    queue.push(measurement);
+    payload.begin(queue, 1);
+    coap.begin(0x12345678);
+  }
+};
+
+static void testEncoding()
+{
+  Fixture fixture;
+  uint32_t start = millis();
+  int code = fixture.coap.post("host", 5683, "/api/v1//measurements/", "key=0123", fixture.payload);
+  CHECK_EQUAL(CoapClient::ERROR_TIMEOUT, code);
+  CHECK_EQUAL(1 + CoapClient::MAX_RETRANSMIT, fixture.udp.sent.size());
+  CHECK(millis() - start >= 15 * CoapClient::ACK_TIMEOUT);
+
+  const std::vector<uint8_t>& request = fixture.udp.sent[0];
+  const uint8_t header[] = { 0x44, 0x02, 0x56, 0x78 };
+  const uint8_t options[] = {
+    0xB3, 'a', 'p', 'i',
+    0x02, 'v', '1',
+    0x0C, 'm', 'e', 'a', 's', 'u', 'r', 'e', 'm', 'e', 'n', 't', 's',
+    0x11, 50,
+    0x38, 'k', 'e', 'y', '=', '0', '1', '2', '3',
+    0xFF
+  };
+  CHECK(memcmp(request.data(), header, sizeof(header)) == 0);
+  CHECK(memcmp(request.data() + 8, options, sizeof(options)) == 0);
+  CHECK_EQUAL(8 + sizeof(options) + fixture.payload.size(), request.size());
+  CHECK_EQUAL('[', request[8 + sizeof(options)]);
+
+  // Retransmissions are the same message
+  CHECK(fixture.udp.sent[1] == request);
+}
+
+// The ACK carries the response; a stale one for another message is ignored
+static void testPiggybacked()
+{
+  Fixture fixture;
+  uint8_t token[4];
+  uint32_t next = 0x12345679;
+  memcpy(token, &next, sizeof(token));
+  std::vector<uint8_t> request = { 0, 0, 0, 0, token[0], token[1], token[2], token[3] };
+
+  fixture.udp.inbox.push_back({ 3, { 0x60, 0x44, 0x00, 0x01 } });
+  fixture.udp.inbox.push_back({ 3, response(TYPE_ACK, 0x44, 0x5678, request) });
+  CHECK_EQUAL(204, fixture.coap.post("host", 5683, "m", nullptr, fixture.payload));
+  CHECK_EQUAL(2, fixture.coap.retransmissions());
+  CHECK_EQUAL(3, fixture.udp.sent.size());
+}
+
+// An empty ACK, then the response as a confirmable message of its own,
+// which gets acknowledged
+static void testSeparate()
+{
+  Fixture fixture;
+  uint8_t token[4];
+  uint32_t next = 0x12345679;
+  memcpy(token, &next, sizeof(token));
+  std::vector<uint8_t> request = { 0, 0, 0, 0, token[0], token[1], token[2], token[3] };
+
+  fixture.udp.inbox.push_back({ 1, { 0x60, 0x00, 0x56, 0x78 } });
+  fixture.udp.inbox.push_back({ 1, response(TYPE_CON, 0x41, 0x9999, request) });
+  CHECK_EQUAL(201, fixture.coap.post("host", 5683, "m", nullptr, fixture.payload));
+  CHECK_EQUAL(0, fixture.coap.retransmissions());
+  CHECK_EQUAL(2, fixture.udp.sent.size());
+
+  const uint8_t ack[] = { 0x60, 0x00, 0x99, 0x99 };
+  CHECK_EQUAL(sizeof(ack), fixture.udp.sent[1].size());
+  CHECK(memcmp(fixture.udp.sent[1].data(), ack, sizeof(ack)) == 0);
+}
+
+static void testReset()
+{
+  Fixture fixture;
+  fixture.udp.inbox.push_back({ 1, { 0x70, 0x00, 0x56, 0x78 } });
+  CHECK_EQUAL(CoapClient::ERROR_RESET, fixture.coap.post("host", 5683, "m", nullptr, fixture.payload));
+}
+
+// Polled, the exchange goes on between calls without ever waiting
+static void testPolled()
+{
+  Fixture fixture;
+  uint8_t token[4];
+  uint32_t next = 0x12345679;
+  memcpy(token, &next, sizeof(token));
+  std::vector<uint8_t> request = { 0, 0, 0, 0, token[0], token[1], token[2], token[3] };
+
+  CHECK(fixture.coap.beginPost("host", 5683, "m", nullptr, fixture.payload));
+  CHECK(fixture.coap.busy());
+  CHECK(!fixture.coap.beginPost("host", 5683, "m", nullptr, fixture.payload));
+
+  uint32_t start = millis();
+  CHECK_EQUAL(CoapClient::PENDING, fixture.coap.pollPost());
+  CHECK_EQUAL(start, millis());
+  CHECK_EQUAL(1, fixture.udp.sent.size());
+
+  // Retransmitted once the ACK timeout has passed
+  delay(CoapClient::ACK_TIMEOUT * 3 / 2);
+  CHECK_EQUAL(CoapClient::PENDING, fixture.coap.pollPost());
+  CHECK_EQUAL(2, fixture.udp.sent.size());
+  CHECK_EQUAL(1, fixture.coap.retransmissions());
+
+  fixture.udp.inbox.push_back({ 2, response(TYPE_ACK, 0x44, 0x5678, request) });
+  CHECK_EQUAL(204, fixture.coap.pollPost());
+  CHECK(!fixture.coap.busy());
+  CHECK_EQUAL(CoapClient::ERROR_SEND, fixture.coap.pollPost());
+}
+
+int main()
+{
+  RUN(testEncoding);
+  RUN(testPiggybacked);
+  RUN(testSeparate);
+  RUN(testReset);
+  RUN(testPolled);
+  return testResult();
+}
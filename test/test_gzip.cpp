@@ -0,0 +1,106 @@
+#include <string>
+#include <zlib.h>
+#include "Arduino.h"
+#include "GzipPayload.h"
+#include "test.h"
+
+static std::string readAll(Stream& stream, size_t chunk)
+{
+  std::string bytes;
+  uint8_t buffer[64];
+  int length;
+  while ((length = stream.read(buffer, min(chunk, sizeof(buffer)))) > 0)
+  {
+    bytes.append((const char*)buffer, length);
+  }
+  return bytes;
+}
+
+static std::string inflateGzip(const std::string& compressed)
+{
+  z_stream stream = {};
+  inflateInit2(&stream, 16 + MAX_WBITS);
+  stream.next_in = (Bytef*)compressed.data();
+  stream.avail_in = compressed.size();
+
+  std::string output;
+  char buffer[4096];
+  int result;
+  do
+  {
+    stream.next_out = (Bytef*)buffer;
+    stream.avail_out = sizeof(buffer);
+    result = inflate(&stream, Z_NO_FLUSH);
+    output.append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (result == Z_OK);
+  inflateEnd(&stream);
+
+  return result == Z_STREAM_END && stream.avail_in == 0 ? output : "<invalid>";
+}
+
+// Every format and batch size inflates back to the payload, and size()
+// matches what is read
+static void testRoundTrip()
+{
+  static GzipPayload gzip;
+  MeasurementPayload::FORMAT formats[] = {
+    MeasurementPayload::FORMAT_JSON, MeasurementPayload::FORMAT_CBOR, MeasurementPayload::FORMAT_COLUMNS
+  };
+
+  for (MeasurementPayload::FORMAT format : formats)
+  {
+    MeasurementPayload payload;
+    payload.setDevice("PMS7003", "abc123", "0.3.2", "Office on the roof", "-57.5", "-25.3", format);
+    MeasurementQueue queue;
+    uint32_t recorded = 1700000000;
+    for (uint8_t count = 1; count <= MeasurementQueue::CAPACITY; count++)
+    {
+      recorded += 120 + count % 3;
+      MeasurementQueue::MEASUREMENT measurement = {
+        recorded, (uint16_t)(5 + count * 7 % 20), (uint16_t)(10 + count * 13 % 40), (uint16_t)(count * 31 % 100)
+      };
+      queue.push(measurement);
+      payload.begin(queue, count);
+      std::string plain = readAll(payload, 64);
+
+      gzip.begin(payload);
+      std::string compressed = readAll(gzip, 37);
+      CHECK_EQUAL(gzip.size(), compressed.size());
+      CHECK(inflateGzip(compressed) == plain);
+
+      // Byte at a time after a rewind gives the same stream
+      gzip.rewind();
+      std::string again;
+      int ch;
+      while ((ch = gzip.read()) >= 0)
+      {
+        again += (char)ch;
+      }
+      CHECK(again == compressed);
+    }
+  }
+}
+
+// Repetitive batches compress well
+static void testRatio()
+{
+  static GzipPayload gzip;
+  MeasurementPayload payload;
+  payload.setDevice("PMS7003", "abc123", "0.3.2", "Office", "-57.5", "-25.3");
+  MeasurementQueue queue;
+  for (uint8_t i = 0; i < MeasurementQueue::CAPACITY; i++)
+  {
+    MeasurementQueue::MEASUREMENT measurement = { 1700000000u + 120 * i, 4, 9, 12 };
+    queue.push(measurement);
+  }
+  payload.begin(queue, queue.count());
+  gzip.begin(payload);
+  CHECK(gzip.size() * 4 < payload.size());
+}
+
+int main()
+{
+  RUN(testRoundTrip);
+  RUN(testRatio);
+  return testResult();
+}
@@ -0,0 +1,184 @@
+#include "Arduino.h"
+#include "MeasurementLog.h"
+#include "test.h"
+
+static MeasurementQueue::MEASUREMENT measurement(uint32_t i)
+{
+  MeasurementQueue::MEASUREMENT m = { i, (uint16_t)i, 2, 3 };
+  return m;
+}
+
+// Drain `log` completely, checking the readings come out in order from `first`
+static uint32_t drain(MeasurementLog& log, uint32_t first)
+{
+  MeasurementQueue::MEASUREMENT items[MeasurementLog::MAX_READ];
+  uint32_t total = 0;
+  uint8_t count;
+  while ((count = log.read(items, MeasurementLog::MAX_READ)) > 0)
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      CHECK_EQUAL(first + total, items[i].recorded);
+      total++;
+    }
+    log.consume(count);
+  }
+  return total;
+}
+
+static void testAppendAndRead()
+{
+  FS fs;
+  MeasurementLog log(fs, "/backlog", 8192);
+  log.begin();
+  for (uint32_t i = 0; i < 100; i++)
+  {
+    log.append(measurement(i));
+  }
+  CHECK_EQUAL(100, log.count());
+
+  // Pages are only written whole, the rest waits in RAM
+  File segment = fs.open("/backlog/0", "r");
+  CHECK_EQUAL(6 * PageBuffer::PAGE_SIZE, segment.size());
+
+  MeasurementQueue::MEASUREMENT items[MeasurementLog::MAX_READ];
+  CHECK_EQUAL(MeasurementLog::MAX_READ, log.read(items, MeasurementLog::MAX_READ));
+  CHECK_EQUAL(0, items[0].recorded);
+  log.consume(10);
+  CHECK_EQUAL(90, log.count());
+  CHECK_EQUAL(90, drain(log, 10));
+  CHECK_EQUAL(0, log.count());
+}
+
+// Readings delivered while their page is still buffered never reach flash
+static void testReadFromBuffer()
+{
+  FS fs;
+  MeasurementLog log(fs, "/backlog", 8192);
+  log.begin();
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    log.append(measurement(i));
+  }
+
+  MeasurementQueue::MEASUREMENT items[MeasurementLog::MAX_READ];
+  CHECK_EQUAL(2, log.read(items, 2));
+  CHECK_EQUAL(0, items[0].recorded);
+  log.consume(2);
+  CHECK_EQUAL(1, log.count());
+  CHECK_EQUAL(1, drain(log, 2));
+  CHECK_EQUAL(0, log.count());
+  CHECK(!fs.exists("/backlog/0"));
+  CHECK(!fs.exists("/backlog/cursor"));
+
+  // What is buffered after that still fills whole pages of the segment
+  uint32_t perPage = PageBuffer::PAGE_SIZE / sizeof(MeasurementLog::RECORD);
+  for (uint32_t i = 3; i < 3 + perPage; i++)
+  {
+    log.append(measurement(i));
+  }
+  File segment = fs.open("/backlog/0", "r");
+  CHECK_EQUAL(PageBuffer::PAGE_SIZE, segment.size());
+  segment.close();
+  CHECK_EQUAL(perPage, drain(log, 3));
+}
+
+// Readings read from the buffer and consumed after it was written out
+static void testBufferWrittenWhileRead()
+{
+  FS fs;
+  MeasurementLog log(fs, "/backlog", 8192);
+  log.begin();
+  uint32_t perPage = PageBuffer::PAGE_SIZE / sizeof(MeasurementLog::RECORD);
+  for (uint32_t i = 0; i < perPage - 2; i++)
+  {
+    log.append(measurement(i));
+  }
+
+  MeasurementQueue::MEASUREMENT items[MeasurementLog::MAX_READ];
+  CHECK_EQUAL(3, log.read(items, 3));
+  for (uint32_t i = perPage - 2; i < perPage + 2; i++)
+  {
+    log.append(measurement(i));
+  }
+  log.consume(3);
+  CHECK_EQUAL(perPage + 2 - 3, log.count());
+  CHECK_EQUAL(perPage + 2 - 3, drain(log, 3));
+}
+
+// A reboot picks up the segments and the read position
+static void testReboot()
+{
+  FS fs;
+  {
+    MeasurementLog log(fs, "/backlog", 8192);
+    log.begin();
+    for (uint32_t i = 0; i < 300; i++)
+    {
+      log.append(measurement(i));
+    }
+    MeasurementQueue::MEASUREMENT items[MeasurementLog::MAX_READ];
+    log.read(items, 5);
+    log.consume(5);
+    log.flush();
+  }
+
+  MeasurementLog log(fs, "/backlog", 8192);
+  log.begin();
+  CHECK_EQUAL(295, log.count());
+  CHECK_EQUAL(295, drain(log, 5));
+}
+
+// Past the size limit the oldest segment goes
+static void testSizeLimit()
+{
+  FS fs;
+  MeasurementLog log(fs, "/backlog", 8192);
+  log.begin();
+  for (uint32_t i = 0; i < 700; i++)
+  {
+    log.append(measurement(i));
+  }
+
+  uint32_t perSegment = MeasurementLog::SEGMENT_SIZE / sizeof(MeasurementLog::RECORD);
+  CHECK_EQUAL(perSegment, log.dropped());
+  CHECK_EQUAL(700 - perSegment, log.count());
+  CHECK_EQUAL(700 - perSegment, drain(log, perSegment));
+}
+
+static void testCorruptedRecord()
+{
+  FS fs;
+  MeasurementLog log(fs, "/backlog", 8192);
+  log.begin();
+  for (uint32_t i = 0; i < 20; i++)
+  {
+    log.append(measurement(i));
+  }
+  log.flush();
+
+  File segment = fs.open("/backlog/0", "r+");
+  segment.seek(3 * sizeof(MeasurementLog::RECORD) + 1);
+  segment.write(0xAA);
+  segment.close();
+
+  MeasurementQueue::MEASUREMENT items[MeasurementLog::MAX_READ];
+  CHECK_EQUAL(3, log.read(items, MeasurementLog::MAX_READ));
+  log.consume(3);
+  CHECK_EQUAL(16, log.read(items, MeasurementLog::MAX_READ));
+  CHECK_EQUAL(4, items[0].recorded);
+  CHECK_EQUAL(1, log.corrupted());
+  log.consume(16);
+  CHECK_EQUAL(0, log.count());
+}
+
+int main()
+{
+  RUN(testAppendAndRead);
+  RUN(testReadFromBuffer);
+  RUN(testBufferWrittenWhileRead);
+  RUN(testReboot);
+  RUN(testSizeLimit);
+  RUN(testCorruptedRecord);
+  return testResult();
+}
@@ -0,0 +1,303 @@
+#include <deque>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+#include "MqttClient.h"
+#include "test.h"
+
+// A broker behind a Client: parses the packets written to it and answers
+// as scripted. CONNECT gets a CONNACK with `connackCode`, PINGREQ a
+// PINGRESP unless `answerPings` is false, and PUBLISH a PUBACK once
+// `dropPubacks` publishes have gone unanswered.
+class FakeBroker : public Client
+{
+  public:
+    struct PACKET
+    {
+      uint8_t header;
+      std::vector<uint8_t> body;
+    };
+
+    std::vector<PACKET> received;
+    std::deque<uint8_t> inbox;
+    uint8_t connackCode = 0;
+    uint8_t dropPubacks = 0;
+    bool answerPings = true;
+    bool open = false;
+
+    int connect(IPAddress /* ip */, uint16_t /* port */) override
+    {
+      open = true;
+      return 1;
+    }
+
+    int connect(const char* /* host */, uint16_t /* port */) override
+    {
+      open = true;
+      return 1;
+    }
+
+    uint8_t connected() override { return open || !inbox.empty(); }
+    void stop() override { open = false; }
+
+    size_t write(uint8_t ch) override
+    {
+      if (!open)
+      {
+        return 0;
+      }
+      _packet.push_back(ch);
+      parse();
+      return 1;
+    }
+
+    int available() override { return inbox.size(); }
+
+    int read() override
+    {
+      if (inbox.empty())
+      {
+        return -1;
+      }
+      uint8_t ch = inbox.front();
+      inbox.pop_front();
+      return ch;
+    }
+
+    int peek() override { return inbox.empty() ? -1 : inbox.front(); }
+
+    // A PUBACK for `packetId`, sent unasked
+    void puback(uint16_t packetId)
+    {
+      inbox.insert(inbox.end(), { 0x40, 0x02, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF) });
+    }
+
+  private:
+    std::vector<uint8_t> _packet;
+
+    // Once _packet holds a whole packet, record and answer it
+    void parse()
+    {
+      uint32_t length = 0;
+      size_t position = 1;
+      uint8_t shift = 0;
+      do
+      {
+        if (position >= _packet.size())
+        {
+          return;
+        }
+        length |= (_packet[position] & 0x7F) << shift;
+        shift += 7;
+      } while (_packet[position++] & 0x80);
+      if (_packet.size() < position + length)
+      {
+        return;
+      }
+
+      PACKET packet = { _packet[0], std::vector<uint8_t>(_packet.begin() + position, _packet.end()) };
+      received.push_back(packet);
+      _packet.clear();
+
+      switch (packet.header >> 4)
+      {
+        case 1:
+          inbox.insert(inbox.end(), { 0x20, 0x02, 0x00, connackCode });
+          break;
+
+        case 3:
+          if (dropPubacks > 0)
+          {
+            dropPubacks--;
+          }
+          else
+          {
+            uint16_t topicLength = (packet.body[0] << 8) | packet.body[1];
+            puback((packet.body[2 + topicLength] << 8) | packet.body[3 + topicLength]);
+          }
+          break;
+
+        case 12:
+          if (answerPings)
+          {
+            inbox.insert(inbox.end(), { 0xD0, 0x00 });
+          }
+          break;
+      }
+    }
+};
+
+struct Fixture
+{
+  MeasurementQueue queue;
+  MeasurementPayload payload;
+  FakeBroker broker;
+  MqttClient mqtt;
+
+  Fixture()
+  {
+    payload.setDevice("PMS7003", "abc123", "0.3.2", "Desc", "-57.5", "-25.3");
+    for (uint32_t i = 0; i < 3; i++)
+    {
+      MeasurementQueue::MEASUREMENT measurement = { 1700000000 + i, 1, 2, 3 };
+      queue.push(measurement);
+    }
+    payload.begin(queue, 3);
+    mqtt.begin(broker);
+  }
+
+  std::string body()
+  {
+    std::string text(payload.size(), '\0');
+    payload.rewind();
+    payload.readBytes(&text[0], text.size());
+    return text;
+  }
+};
+
+static std::string readString(const std::vector<uint8_t>& body, size_t& position)
+{
+  uint16_t length = (body[position] << 8) | body[position + 1];
+  std::string text(body.begin() + position + 2, body.begin() + position + 2 + length);
+  position += 2 + length;
+  return text;
+}
+
+static void testConnect()
+{
+  Fixture fixture;
+  CHECK_EQUAL(0, fixture.mqtt.connect("host", 1883, "linka-abc123", "abc123", "key"));
+  CHECK(fixture.mqtt.connected());
+  CHECK_EQUAL(1, fixture.broker.received.size());
+
+  const FakeBroker::PACKET& connect = fixture.broker.received[0];
+  const uint8_t variable[] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0xC2, 0x00, 60 };
+  CHECK_EQUAL(0x10, connect.header);
+  CHECK(memcmp(connect.body.data(), variable, sizeof(variable)) == 0);
+  size_t position = sizeof(variable);
+  CHECK(readString(connect.body, position) == "linka-abc123");
+  CHECK(readString(connect.body, position) == "abc123");
+  CHECK(readString(connect.body, position) == "key");
+  CHECK_EQUAL(connect.body.size(), position);
+
+  fixture.mqtt.disconnect();
+  CHECK(!fixture.mqtt.connected());
+  CHECK_EQUAL(0xE0, fixture.broker.received.back().header);
+}
+
+static void testConnectRefused()
+{
+  Fixture fixture;
+  fixture.broker.connackCode = 5;
+  CHECK_EQUAL(5, fixture.mqtt.connect("host", 1883, "linka-abc123", nullptr, nullptr));
+  CHECK(!fixture.mqtt.connected());
+  CHECK(!fixture.broker.open);
+  CHECK_EQUAL(0x02, fixture.broker.received[0].body[7]);
+}
+
+// The payload goes out at QoS 1 and publish() returns on its PUBACK
+static void testPublish()
+{
+  Fixture fixture;
+  fixture.mqtt.connect("host", 1883, "linka-abc123", "abc123", "key");
+  CHECK_EQUAL(0, fixture.mqtt.publish("linka/measurements", fixture.payload));
+  CHECK_EQUAL(0, fixture.mqtt.retransmissions());
+  CHECK_EQUAL(2, fixture.broker.received.size());
+
+  const FakeBroker::PACKET& publish = fixture.broker.received[1];
+  CHECK_EQUAL(0x32, publish.header);
+  size_t position = 0;
+  CHECK(readString(publish.body, position) == "linka/measurements");
+  CHECK_EQUAL(1, (publish.body[position] << 8) | publish.body[position + 1]);
+  CHECK(std::string(publish.body.begin() + position + 2, publish.body.end()) == fixture.body());
+
+  // The next message gets the next packet identifier
+  CHECK_EQUAL(0, fixture.mqtt.publish("linka/measurements", fixture.payload));
+  CHECK_EQUAL(2, (fixture.broker.received[2].body[position] << 8) | fixture.broker.received[2].body[position + 1]);
+}
+
+// Without a PUBACK the message is sent again, with DUP set and the same
+// packet identifier
+static void testRetransmit()
+{
+  Fixture fixture;
+  fixture.mqtt.connect("host", 1883, "linka-abc123", "abc123", "key");
+  fixture.broker.dropPubacks = 1;
+
+  uint32_t start = millis();
+  CHECK_EQUAL(0, fixture.mqtt.publish("linka/measurements", fixture.payload));
+  CHECK(millis() - start >= MqttClient::ACK_TIMEOUT);
+  CHECK_EQUAL(1, fixture.mqtt.retransmissions());
+  CHECK_EQUAL(3, fixture.broker.received.size());
+
+  const FakeBroker::PACKET& first = fixture.broker.received[1];
+  const FakeBroker::PACKET& again = fixture.broker.received[2];
+  CHECK_EQUAL(0x3A, again.header);
+  CHECK(first.body == again.body);
+  CHECK(fixture.mqtt.connected());
+}
+
+// Never acknowledged: given up after the retransmission, and the connection
+// is closed
+static void testNoPuback()
+{
+  Fixture fixture;
+  fixture.mqtt.connect("host", 1883, "linka-abc123", "abc123", "key");
+  fixture.broker.dropPubacks = 1 + MqttClient::MAX_RETRANSMIT;
+
+  CHECK_EQUAL(MqttClient::ERROR_TIMEOUT, fixture.mqtt.publish("linka/measurements", fixture.payload));
+  CHECK_EQUAL(2 + MqttClient::MAX_RETRANSMIT, fixture.broker.received.size());
+  CHECK(!fixture.mqtt.connected());
+  CHECK_EQUAL(MqttClient::ERROR_CONNECTION, fixture.mqtt.publish("linka/measurements", fixture.payload));
+}
+
+// A late PUBACK for an earlier message doesn't count for this one
+static void testStalePuback()
+{
+  Fixture fixture;
+  fixture.mqtt.connect("host", 1883, "linka-abc123", "abc123", "key");
+  fixture.broker.dropPubacks = 1;
+  fixture.broker.puback(7);
+
+  CHECK_EQUAL(0, fixture.mqtt.publish("linka/measurements", fixture.payload));
+  CHECK_EQUAL(1, fixture.mqtt.retransmissions());
+}
+
+// Idle connections are pinged; one that stops answering is closed
+static void testKeepAlive()
+{
+  Fixture fixture;
+  fixture.mqtt.connect("host", 1883, "linka-abc123", "abc123", "key");
+
+  fixture.mqtt.loop();
+  CHECK_EQUAL(1, fixture.broker.received.size());
+
+  delay(MqttClient::KEEP_ALIVE * 1000UL);
+  fixture.mqtt.loop();
+  CHECK_EQUAL(2, fixture.broker.received.size());
+  CHECK_EQUAL(0xC0, fixture.broker.received.back().header);
+  fixture.mqtt.loop();
+  delay(MqttClient::ACK_TIMEOUT);
+  fixture.mqtt.loop();
+  CHECK(fixture.mqtt.connected());
+
+  fixture.broker.answerPings = false;
+  delay(MqttClient::KEEP_ALIVE * 1000UL);
+  fixture.mqtt.loop();
+  CHECK_EQUAL(3, fixture.broker.received.size());
+  delay(MqttClient::ACK_TIMEOUT);
+  fixture.mqtt.loop();
+  CHECK(!fixture.mqtt.connected());
+}
+
+int main()
+{
+  RUN(testConnect);
+  RUN(testConnectRefused);
+  RUN(testPublish);
+  RUN(testRetransmit);
+  RUN(testNoPuback);
+  RUN(testStalePuback);
+  RUN(testKeepAlive);
+  return testResult();
+}
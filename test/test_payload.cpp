@@ -0,0 +1,153 @@
+#include <string>
+#include "Arduino.h"
+#include "MeasurementPayload.h"
+#include "test.h"
+
+static std::string readAll(MeasurementPayload& payload, size_t chunk)
+{
+  std::string text;
+  uint8_t buffer[64];
+  int length;
+  while ((length = payload.read(buffer, min(chunk, sizeof(buffer)))) > 0)
+  {
+    text.append((const char*)buffer, length);
+  }
+  return text;
+}
+
+static std::string hex(const std::string& bytes)
+{
+  std::string text;
+  char digits[3];
+  for (unsigned char byte : bytes)
+  {
+    snprintf(digits, sizeof(digits), "%02x", byte);
+    text += digits;
+  }
+  return text;
+}
+
+static void fillQueue(MeasurementQueue& queue)
+{
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    MeasurementQueue::MEASUREMENT measurement = { 1700000000 + i * 60, (uint16_t)(i * 7), (uint16_t)(i * 100 + 5), 65535 };
+    queue.push(measurement);
+  }
+}
+
+static void testJson()
+{
+  MeasurementQueue queue;
+  fillQueue(queue);
+  MeasurementPayload payload;
+  payload.setDevice("PMS7003", "abc123", "0.3.2", "Office \"A\"", "-57.5", "-25.3");
+  CHECK(strcmp(payload.contentType(), "application/json") == 0);
+
+  payload.begin(queue, 1);
+  std::string expected =
+    "[{\"sensor\": \"PMS7003\",\"source\": \"abc123\",\"version\": \"0.3.2\","
+    "\"description\": \"Office \\\"A\\\"\",\"pm1dot0\":     0,\"pm2dot5\":     5,"
+    "\"pm10\": 65535,\"longitude\": -57.5,\"latitude\": -25.3,"
+    "\"recorded\": \"2023-11-14T22:13:20.000Z\"}]";
+  CHECK_EQUAL(expected.size(), payload.size());
+  CHECK(readAll(payload, 64) == expected);
+
+  // Every reading has the same length
+  payload.begin(queue, 3);
+  std::string text = readAll(payload, 64);
+  CHECK_EQUAL(3 * (expected.size() - 2) + 2 + 2, text.size());
+  CHECK_EQUAL(text.size(), payload.size());
+  CHECK(text.find("\"pm1dot0\":    14,\"pm2dot5\":   205") != std::string::npos);
+  CHECK(text.find("\"recorded\": \"2023-11-14T22:15:20.000Z\"}]") != std::string::npos);
+}
+
+// Byte at a time, odd chunks and a rewind all give the same document
+static void testReading()
+{
+  MeasurementQueue queue;
+  fillQueue(queue);
+  MeasurementPayload payload;
+  payload.setDevice("PMS7003", "abc123", "0.3.2", "Office", "-57.5", "-25.3");
+  payload.begin(queue, 3);
+  std::string bulk = readAll(payload, 64);
+  CHECK_EQUAL(0, payload.available());
+  CHECK_EQUAL(-1, payload.read());
+
+  payload.rewind();
+  CHECK_EQUAL('[', payload.peek());
+  std::string single;
+  int ch;
+  while ((ch = payload.read()) >= 0)
+  {
+    single += (char)ch;
+  }
+  CHECK(single == bulk);
+
+  payload.rewind();
+  CHECK(readAll(payload, 7) == bulk);
+
+  MeasurementQueue empty;
+  payload.begin(empty, 0);
+  CHECK(readAll(payload, 64) == "[]");
+  CHECK_EQUAL(2, payload.size());
+}
+
+static void testCbor()
+{
+  MeasurementQueue queue;
+  fillQueue(queue);
+  MeasurementPayload payload;
+  payload.setDevice("PMS7003", "abc123", "0.3.2", "Office \"A\"", "-57.5", "-25.3",
+                    MeasurementPayload::FORMAT_CBOR);
+  CHECK(strcmp(payload.contentType(), "application/cbor") == 0);
+  CHECK_EQUAL(60, payload.contentFormat());
+
+  // [{0: "PMS7003", 1: "abc123", 2: "0.3.2", 3: "Office \"A\"", 4: 0, 5: 5,
+  //   6: 65535, 7: -57.5, 8: -25.3, 9: 1(1700000000)}]
+  payload.begin(queue, 1);
+  CHECK(hex(readAll(payload, 64)) ==
+        "81aa0067504d533730303301666162633132330265302e332e32036a4f66666963652022412204"
+        "190000051900050619ffff07fac266000008fac1ca666609c11a6553f100");
+
+  payload.begin(queue, 3);
+  std::string bytes = readAll(payload, 5);
+  CHECK_EQUAL(bytes.size(), payload.size());
+  CHECK_EQUAL(0x83, (uint8_t)bytes[0]);
+  CHECK(hex(bytes).find("0419000e051900cd0619ffff") != std::string::npos);
+}
+
+static void testColumns()
+{
+  MeasurementQueue queue;
+  fillQueue(queue);
+  MeasurementPayload payload;
+  payload.setDevice("PMS7003", "abc123", "0.3.2", "Office", "-57.5", "-25.3",
+                    MeasurementPayload::FORMAT_COLUMNS);
+
+  payload.begin(queue, 3);
+  std::string expected =
+    "{\"sensor\": \"PMS7003\",\"source\": \"abc123\",\"version\": \"0.3.2\","
+    "\"description\": \"Office\",\"longitude\": -57.5,\"latitude\": -25.3,"
+    "\"recorded\": \"2023-11-14T22:13:20.000Z\",\"recorded_deltas\": [0,60,60],"
+    "\"pm1dot0\": [0,7,14],\"pm2dot5\": [5,105,205],\"pm10\": [65535,65535,65535]}";
+  CHECK_EQUAL(expected.size(), payload.size());
+  CHECK(readAll(payload, 3) == expected);
+
+  // The clock may be set back between readings
+  MeasurementQueue::MEASUREMENT earlier = { 1700000000 - 3600, 1, 2, 3 };
+  queue.push(earlier);
+  payload.begin(queue, 4);
+  std::string text = readAll(payload, 64);
+  CHECK_EQUAL(text.size(), payload.size());
+  CHECK(text.find("\"recorded_deltas\": [0,60,60,-3720]") != std::string::npos);
+}
+
+int main()
+{
+  RUN(testJson);
+  RUN(testReading);
+  RUN(testCbor);
+  RUN(testColumns);
+  return testResult();
+}
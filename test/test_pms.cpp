@@ -0,0 +1,268 @@
+#include "Arduino.h"
+#include "PMS.h"
+#include "support.h"
+#include "test.h"
+
+// Read everything `stream` holds, returning the number of frames accepted
+static uint32_t readAll(PMS& pms, MemoryStream& stream, PMS::DATA& last)
+{
+  uint32_t frames = 0;
+  PMS::DATA data;
+  while (stream.position < stream.input.size())
+  {
+    if (pms.read(data))
+    {
+      last = data;
+      frames++;
+    }
+  }
+  while (pms.read(data))
+  {
+    last = data;
+    frames++;
+  }
+  return frames;
+}
+
+static void testCleanFrames()
+{
+  MemoryStream stream;
+  for (uint16_t i = 0; i < 10; i++)
+  {
+    appendFrame(stream.input, 100 * i);
+  }
+
+  PMS pms(stream);
+  PMS::DATA data;
+  CHECK_EQUAL(10, readAll(pms, stream, data));
+  CHECK_EQUAL(900, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(901, data.PM_SP_UG_2_5);
+  CHECK_EQUAL(902, data.PM_SP_UG_10_0);
+  CHECK_EQUAL(903, data.PM_AE_UG_1_0);
+  CHECK_EQUAL(906, data.PM_TOTALPARTICLES_0_3);
+  CHECK_EQUAL(911, data.PM_TOTALPARTICLES_10_0);
+
+  PMS::STATS stats = pms.stats();
+  CHECK_EQUAL(320, stats.bytesRead);
+  CHECK_EQUAL(10, stats.framesAccepted);
+  CHECK_EQUAL(0, stats.checksumErrors);
+  CHECK_EQUAL(0, stats.resyncs);
+  CHECK_EQUAL(0, stats.lengthErrors);
+
+  pms.resetStats();
+  CHECK_EQUAL(0, pms.stats().bytesRead);
+}
+
+// Bytes trickling in one at a time end up in the same frames
+static void testByteAtATime()
+{
+  MemoryStream stream;
+  stream.chunk = 1;
+  for (uint16_t i = 0; i < 5; i++)
+  {
+    appendFrame(stream.input, i);
+  }
+
+  PMS pms(stream);
+  PMS::DATA data;
+  CHECK_EQUAL(5, readAll(pms, stream, data));
+  CHECK_EQUAL(4, data.PM_SP_UG_1_0);
+}
+
+static void testNoise()
+{
+  MemoryStream stream;
+  const uint8_t noise[] = { 0x00, 0x13, 0xFF, 0x4D, 0x42, 0x00 };
+  appendFrame(stream.input, 1);
+  stream.input.insert(stream.input.end(), noise, noise + sizeof(noise));
+  appendFrame(stream.input, 2);
+
+  PMS pms(stream);
+  PMS::DATA data;
+  CHECK_EQUAL(2, readAll(pms, stream, data));
+  CHECK_EQUAL(2, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(sizeof(noise) - 1, pms.stats().resyncs);   // 0x42 0x00 is one false start
+}
+
+static void testChecksumError()
+{
+  MemoryStream stream;
+  appendFrame(stream.input, 1);
+  appendFrame(stream.input, 2, true);
+  appendFrame(stream.input, 3);
+
+  PMS pms(stream);
+  PMS::DATA data;
+  CHECK_EQUAL(2, readAll(pms, stream, data));
+  CHECK_EQUAL(3, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(1, pms.stats().checksumErrors);
+}
+
+static void testLengthError()
+{
+  MemoryStream stream;
+  appendFrame(stream.input, 1);
+  stream.input[3] = 40;
+  appendFrame(stream.input, 2);
+
+  PMS pms(stream);
+  PMS::DATA data;
+  CHECK_EQUAL(1, readAll(pms, stream, data));
+  CHECK_EQUAL(2, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(1, pms.stats().lengthErrors);
+}
+
+// A frame cut short swallows the start of the next one, the parser is back
+// in sync after that
+static void testTruncatedFrame()
+{
+  MemoryStream stream;
+  appendFrame(stream.input, 1);
+  stream.input.resize(20);
+  appendFrame(stream.input, 2);
+  appendFrame(stream.input, 3);
+  appendFrame(stream.input, 4);
+
+  PMS pms(stream);
+  PMS::DATA data;
+  CHECK(readAll(pms, stream, data) >= 2);
+  CHECK_EQUAL(4, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(1, pms.stats().checksumErrors);
+}
+
+// feed() makes the same decisions as the Stream path
+static void testFeed()
+{
+  std::vector<uint8_t> bytes;
+  appendFrame(bytes, 7);
+  bytes.push_back(0x55);
+  appendFrame(bytes, 8, true);
+  appendFrame(bytes, 9);
+
+  MemoryStream stream;
+  PMS pms(stream);
+  PMS::DATA data;
+  uint32_t timestamp;
+  uint32_t frames = 0;
+  size_t offset = 0;
+  while (offset < bytes.size())
+  {
+    size_t consumed;
+    if (pms.feed(bytes.data() + offset, bytes.size() - offset, consumed))
+    {
+      frames++;
+    }
+    offset += consumed;
+  }
+
+  CHECK_EQUAL(2, frames);
+  CHECK(pms.latest(data, timestamp));
+  CHECK_EQUAL(9, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(1, pms.stats().checksumErrors);
+  CHECK_EQUAL(1, pms.stats().resyncs);
+}
+
+// Commands come out complete, with their checksums, in order
+static void testCommands()
+{
+  MemoryStream stream;
+  PMS pms(stream);
+  pms.passiveMode();
+  pms.wakeUp();
+  pms.requestRead();
+  pms.sleep();
+  pms.activeMode();
+  pms.requestRead();        // Ignored in active mode
+  pms.flush();
+
+  const uint8_t expected[] = {
+    0x42, 0x4D, 0xE1, 0x00, 0x00, 0x01, 0x70,
+    0x42, 0x4D, 0xE4, 0x00, 0x01, 0x01, 0x74,
+    0x42, 0x4D, 0xE2, 0x00, 0x00, 0x01, 0x71,
+    0x42, 0x4D, 0xE4, 0x00, 0x00, 0x01, 0x73,
+    0x42, 0x4D, 0xE1, 0x00, 0x01, 0x01, 0x71,
+  };
+  CHECK_EQUAL(sizeof(expected), stream.output.size());
+  CHECK(memcmp(expected, stream.output.data(), min(sizeof(expected), stream.output.size())) == 0);
+}
+
+static void testPollReadTimeout()
+{
+  MemoryStream stream;
+  PMS pms(stream);
+  pms.passiveMode();
+  pms.flush();
+
+  PMS::DATA data;
+  pms.beginRead(100, 1);
+  CHECK_EQUAL(PMS::READ_PENDING, pms.pollRead(data));
+
+  // Nothing arrives: one retry, then a timeout
+  PMS::READ_STATUS status;
+  uint32_t polls = 0;
+  do
+  {
+    delay(10);
+    status = pms.pollRead(data);
+    polls++;
+  } while (status == PMS::READ_PENDING && polls < 1000);
+  CHECK_EQUAL(PMS::READ_TIMEOUT, status);
+  CHECK_EQUAL(1, pms.stats().timeouts);
+  CHECK_EQUAL(PMS::READ_IDLE, pms.pollRead(data));
+
+  // A frame arriving completes the next read
+  pms.beginRead(100, 0);
+  appendFrame(stream.input, 42);
+  do
+  {
+    delay(10);
+    status = pms.pollRead(data);
+  } while (status == PMS::READ_PENDING);
+  CHECK_EQUAL(PMS::READ_OK, status);
+  CHECK_EQUAL(42, data.PM_SP_UG_1_0);
+}
+
+// A request queued behind other commands still gets its full timeout once
+// it has been sent
+static void testPollReadQueued()
+{
+  MemoryStream stream;
+  PMS pms(stream);
+  pms.passiveMode();
+  pms.wakeUp();
+
+  PMS::DATA data;
+  pms.beginRead(100, 0);
+  PMS::READ_STATUS status;
+  uint32_t sent = 0;
+  do
+  {
+    delay(10);
+    status = pms.pollRead(data);
+    if (0 == sent && stream.output.size() == 3 * 7)
+    {
+      sent = millis();
+    }
+    if (sent > 0 && millis() - sent >= 50 && stream.input.empty())
+    {
+      appendFrame(stream.input, 7);
+    }
+  } while (status == PMS::READ_PENDING);
+  CHECK_EQUAL(PMS::READ_OK, status);
+  CHECK_EQUAL(7, data.PM_SP_UG_1_0);
+}
+
+int main()
+{
+  RUN(testCleanFrames);
+  RUN(testByteAtATime);
+  RUN(testNoise);
+  RUN(testChecksumError);
+  RUN(testLengthError);
+  RUN(testTruncatedFrame);
+  RUN(testFeed);
+  RUN(testCommands);
+  RUN(testPollReadTimeout);
+  RUN(testPollReadQueued);
+  return testResult();
+}
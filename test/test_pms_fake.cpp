@@ -0,0 +1,182 @@
+#include "Arduino.h"
+#include "PMS.h"
+#include "PMSCapture.h"
+#include "PMSFake.h"
+#include "support.h"
+#include "test.h"
+
+static void loadScenario(PMSFake& fake, const char* csv)
+{
+  MemoryStream stream;
+  stream.input.assign(csv, csv + strlen(csv));
+  CHECK(fake.loadScenario(stream));
+}
+
+// Poll one passive mode read to completion
+static PMS::READ_STATUS readFrame(PMS& pms, PMS::DATA& data, uint16_t timeout = 100)
+{
+  PMS::READ_STATUS status;
+  pms.beginRead(timeout, 0);
+  do
+  {
+    delay(1);
+    status = pms.pollRead(data);
+  } while (status == PMS::READ_PENDING);
+  return status;
+}
+
+// The same seed and scenario give the same bytes
+static void testDeterministic()
+{
+  std::vector<uint8_t> runs[3];
+  uint32_t seeds[] = { 7, 7, 8 };
+  for (uint8_t run = 0; run < 3; run++)
+  {
+    PMSFake fake(seeds[run]);
+    fake.setFrameInterval(0);
+    loadScenario(fake, "5,10,20,30,4\n3,50,80,120,10,spike\n");
+    while (runs[run].size() < 32 * 20)
+    {
+      int ch = fake.read();
+      if (ch >= 0)
+      {
+        runs[run].push_back(ch);
+      }
+    }
+  }
+
+  CHECK(runs[0] == runs[1]);
+  CHECK(runs[0] != runs[2]);
+}
+
+static void testScenario()
+{
+  PMSFake fake(42);
+  fake.setFrameInterval(0);
+  loadScenario(fake, "# comment\n2,10,20,30,0\n1,10,20,30,0,dropout\n1,10,20,30,0,corrupt\r\n1,10,20,30,0,spike\n");
+
+  PMS pms(fake);
+  pms.passiveMode();
+  pms.flush();
+
+  PMS::DATA data;
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));
+  CHECK_EQUAL(10, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(20, data.PM_SP_UG_2_5);
+  CHECK_EQUAL(30, data.PM_SP_UG_10_0);
+  CHECK(data.PM_TOTALPARTICLES_0_3 > data.PM_TOTALPARTICLES_10_0);
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));
+  CHECK_EQUAL(PMS::READ_TIMEOUT, readFrame(pms, data));      // Dropout
+  CHECK_EQUAL(PMS::READ_TIMEOUT, readFrame(pms, data));      // Corrupt
+  CHECK_EQUAL(1, pms.stats().checksumErrors);
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));           // Spike
+  CHECK_EQUAL(50, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));           // Loops
+  CHECK_EQUAL(10, data.PM_SP_UG_1_0);
+}
+
+static void testInvalidScenario()
+{
+  PMSFake fake(1);
+  MemoryStream stream;
+  const char* csv = "1,2,3\n";
+  stream.input.assign(csv, csv + strlen(csv));
+  CHECK(!fake.loadScenario(stream));
+}
+
+// A capture plays back frame for frame, bad ones included, then the
+// scenario takes over
+static void testCapture()
+{
+  FS fs;
+  PMSCapture capture(fs, "/pms.cap", 65536);
+  capture.begin();
+  for (uint16_t i = 1; i <= 3; i++)
+  {
+    std::vector<uint8_t> frame;
+    appendFrame(frame, 100 * i, i == 2);
+    capture.append(frame.data(), frame.size(), i != 2);
+  }
+  capture.flush();
+
+  PMSFake fake(5);
+  fake.setFrameInterval(0);
+  loadScenario(fake, "0,10,20,30,0\n");
+  File file = fs.open("/pms.cap", "r");
+  fake.loadCapture(file);
+
+  PMS pms(fake);
+  pms.passiveMode();
+  pms.flush();
+
+  PMS::DATA data;
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));
+  CHECK_EQUAL(100, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(PMS::READ_TIMEOUT, readFrame(pms, data));
+  CHECK_EQUAL(1, pms.stats().checksumErrors);
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));
+  CHECK_EQUAL(300, data.PM_SP_UG_1_0);
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data));
+  CHECK_EQUAL(10, data.PM_SP_UG_1_0);
+}
+
+// In passive mode a request is answered once the frame interval has passed
+// since the previous frame
+static void testPassiveInterval()
+{
+  PMSFake fake(4);
+  fake.setFrameInterval(300);
+  PMS pms(fake);
+  PMS::DATA data;
+  pms.passiveMode();
+  pms.flush();
+
+  uint32_t start = millis();
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data, 1000));
+  CHECK(millis() - start >= 300);
+
+  // Requested right after a frame: held until the interval is over
+  start = millis();
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data, 1000));
+  CHECK(millis() - start >= 300);
+
+  // Requested once the interval is over: answered at once
+  delay(300);
+  start = millis();
+  CHECK_EQUAL(PMS::READ_OK, readFrame(pms, data, 1000));
+  CHECK(millis() - start < 10);
+
+  // Held longer than the read waits
+  fake.setFrameInterval(2000);
+  CHECK_EQUAL(PMS::READ_TIMEOUT, readFrame(pms, data, 1000));
+}
+
+// Asleep, the fake is silent; in active mode it sends on its own
+static void testCommands()
+{
+  PMSFake fake(3);
+  PMS pms(fake);
+  PMS::DATA data;
+
+  pms.sleep();
+  pms.flush();
+  delay(2000);
+  CHECK(!pms.read(data));
+
+  pms.wakeUp();
+  pms.activeMode();
+  pms.flush();
+  delay(PMSFake::FRAME_INTERVAL);
+  CHECK(pms.read(data));
+}
+
+int main()
+{
+  RUN(testDeterministic);
+  RUN(testScenario);
+  RUN(testInvalidScenario);
+  RUN(testCapture);
+  RUN(testPassiveInterval);
+  RUN(testCommands);
+  return testResult();
+}
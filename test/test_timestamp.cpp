@@ -0,0 +1,87 @@
+#include "Arduino.h"
+#include "Timestamp.h"
+#include "test.h"
+
+static bool matchesGmtime(Timestamp& timestamp, uint32_t epoch)
+{
+  time_t time = epoch;
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  char expected[32];
+  strftime(expected, sizeof(expected), "%Y-%m-%dT%H:%M:%S.000Z", &tm);
+
+  char buffer[Timestamp::ISO8601_LENGTH];
+  timestamp.formatIso8601(buffer, epoch);
+  if (memcmp(buffer, expected, sizeof(buffer)) != 0)
+  {
+    printf("%u: %.24s, expected %s\n", epoch, buffer, expected);
+    return false;
+  }
+  return true;
+}
+
+// Walking forward exercises the cached, incremental path
+static void testSequential()
+{
+  Timestamp timestamp;
+  uint32_t mismatches = 0;
+  for (uint64_t epoch = 0; epoch <= 0xFFFFFFFF; epoch += 7 * 3600 + 13)
+  {
+    mismatches += !matchesGmtime(timestamp, epoch);
+  }
+  CHECK_EQUAL(0, mismatches);
+}
+
+// Jumping around exercises the full conversion
+static void testRandom()
+{
+  Timestamp timestamp;
+  uint32_t mismatches = 0;
+  uint32_t epoch = 1;
+  for (uint32_t i = 0; i < 100000; i++)
+  {
+    epoch ^= epoch << 13;
+    epoch ^= epoch >> 17;
+    epoch ^= epoch << 5;
+    mismatches += !matchesGmtime(timestamp, epoch);
+  }
+  CHECK(matchesGmtime(timestamp, 951782400));       // 2000-02-29
+  CHECK(matchesGmtime(timestamp, 4102444799));      // 2099-12-31T23:59:59
+  CHECK_EQUAL(0, mismatches);
+}
+
+static void testBreakdown()
+{
+  Timestamp timestamp;
+  const Timestamp::CALENDAR& calendar = timestamp.breakdown(1700000000);
+  CHECK_EQUAL(2023, calendar.year);
+  CHECK_EQUAL(11, calendar.month);
+  CHECK_EQUAL(14, calendar.day);
+  CHECK_EQUAL(22, calendar.hour);
+  CHECK_EQUAL(13, calendar.minute);
+  CHECK_EQUAL(20, calendar.second);
+}
+
+static void testFormatNumber()
+{
+  char buffer[8];
+  Timestamp::formatNumber(buffer, 5, 0, ' ');
+  CHECK(memcmp(buffer, "    0", 5) == 0);
+  Timestamp::formatNumber(buffer, 5, 1200, ' ');
+  CHECK(memcmp(buffer, " 1200", 5) == 0);
+  Timestamp::formatNumber(buffer, 5, 65535, ' ');
+  CHECK(memcmp(buffer, "65535", 5) == 0);
+  Timestamp::formatNumber(buffer, 4, 7);
+  CHECK(memcmp(buffer, "0007", 4) == 0);
+  Timestamp::formatNumber(buffer, 2, 10);
+  CHECK(memcmp(buffer, "10", 2) == 0);
+}
+
+int main()
+{
+  RUN(testSequential);
+  RUN(testRandom);
+  RUN(testBreakdown);
+  RUN(testFormatNumber);
+  return testResult();
+}